@@ -31,16 +31,45 @@ sibligs_list_t parseCPUSiblings(std::string s) {
     return siblings;
 }
 
+// Parse a list like 0-3,8,10-11
+std::vector<cpu_id_t> parseCPUList(std::string s) {
+    std::replace(s.begin(), s.end(), ',', ' ');
+    std::stringstream ss(std::move(s));
+    std::vector<cpu_id_t> cpus;
+    std::string range;
+    while (ss >> range) {
+        std::stringstream rs(range);
+        cpu_id_t first, last;
+        char dash;
+        rs >> first;
+        last = first;
+        if (rs >> dash) {
+            rs >> last;
+        }
+        for (auto id = first; id <= last; id++) {
+            cpus.push_back(id);
+        }
+    }
+    return cpus;
+}
+
+std::vector<cpu_id_t> getAllCPUs() {
+    std::vector<cpu_id_t> cpus(std::thread::hardware_concurrency());
+    for (cpu_id_t id = 0; id < cpus.size(); id++) {
+        cpus[id] = id;
+    }
+    return cpus;
+}
+
 std::tuple<
     std::vector<CPU>, std::vector<SMTCPU>
-> getSysCPUs() {
+> getSysCPUs(const std::vector<cpu_id_t>& ids) {
     std::vector<CPU> cpus;
     std::vector<SMTCPU> smtcpus;
-    auto num_cpus = std::thread::hardware_concurrency();
     auto is_smt = [](const sibligs_list_t& sl) { return sl.first != sl.second; };
     auto is_main = [](cpu_id_t id, const sibligs_list_t& sl) { return id == sl.first; };
     auto get_sibling = [](cpu_id_t, const sibligs_list_t& sl) { return sl.second; };
-    for (cpu_id_t id = 0; id < num_cpus; id++) {
+    for (auto id: ids) {
         auto tsl_contents = readThreadSiblingsList(id);
         auto sl = parseCPUSiblings(std::move(tsl_contents));
         if (is_smt(sl)) {
@@ -64,12 +93,36 @@ std::tuple<
 }
 
 CPUTopology getSysCPUTopology() {
-    auto cpu_tup = getSysCPUs();
+    return getSysCPUTopology(getAllCPUs());
+}
+
+CPUTopology getSysCPUTopology(const std::vector<cpu_id_t>& ids) {
+    auto cpu_tup = getSysCPUs(ids);
     auto& cpus = std::get<0>(cpu_tup);
     auto& smtcpus = std::get<1>(cpu_tup);
     return CPUTopology(cpus.begin(), cpus.end(), smtcpus.begin(), smtcpus.end());
 }
 
+std::vector<std::vector<cpu_id_t>> getSysNUMANodes() {
+    std::vector<std::vector<cpu_id_t>> nodes;
+    for (unsigned node = 0;; node++) {
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!f) {
+            break;
+        }
+        std::string list;
+        std::getline(f, list);
+        auto cpus = parseCPUList(std::move(list));
+        if (!cpus.empty()) {
+            nodes.emplace_back(std::move(cpus));
+        }
+    }
+    if (nodes.empty()) {
+        nodes.emplace_back(getAllCPUs());
+    }
+    return nodes;
+}
+
 // Schedule all work to smt cores, then non smt cores, then hyperthreads
 std::vector<work_dist_t> distributeWork(
     const CPUTopology& topology, size_t work, size_t launch_threads
@@ -66,6 +66,12 @@ public:
 };
 
 CPUTopology getSysCPUTopology();
+// Topology of the given CPUs only
+CPUTopology getSysCPUTopology(const std::vector<cpu_id_t>& cpus);
+
+// CPUs of every NUMA node, a single node with all CPUs
+// if the system does not report any
+std::vector<std::vector<cpu_id_t>> getSysNUMANodes();
 
 using work_dist_t = std::pair<std::pair<cpu_id_t, cpu_id_t>, size_t>;
 
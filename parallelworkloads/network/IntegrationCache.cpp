@@ -0,0 +1,123 @@
+#include "IntegrationCache.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+// Adding 0.0 turns -0.0 into 0.0 so both hash alike
+uint64_t DoubleBits(double x) {
+    x += 0.0;
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+}
+
+bool IntegralKey::operator==(const IntegralKey& other) const {
+    return DoubleBits(l) == DoubleBits(other.l) and
+           DoubleBits(r) == DoubleBits(other.r) and
+           n == other.n;
+}
+
+size_t IntegralKeyHash::operator()(const IntegralKey& key) const {
+    uint64_t h = DoubleBits(key.l);
+    h = h * 0x9E3779B97F4A7C15ull ^ DoubleBits(key.r);
+    h = h * 0x9E3779B97F4A7C15ull ^ key.n;
+    return h ^ (h >> 29);
+}
+
+std::vector<IntegralKey> alignedSegments(
+    double l, double r, size_t n, size_t block_n, size_t max_blocks
+) {
+    // The grid indices below must fit in int64_t
+    if (!n or !block_n or !(l < r) or n > size_t(INT64_MAX)) {
+        return { { l, r, n } };
+    }
+
+    // Index of l on the grid of multiples of the step
+    double step = (r - l) / n;
+    double anchor = 0.0;
+    double m = std::round(l / step);
+    if (std::fabs(l / step - m) > 1e-9 * std::max(1.0, std::fabs(m)) or
+        std::fabs(m) + n > 9007199254740992.0
+    ) {
+        anchor = l;
+        m = 0.0;
+    }
+    auto first = static_cast<int64_t>(m);
+    auto last = first + static_cast<int64_t>(n);
+    auto block = static_cast<int64_t>(block_n);
+    // First and last block boundaries inside the range
+    auto first_block = first >= 0 ? (first + block - 1) / block: -(-first / block);
+    auto last_block = last >= 0 ? last / block: -((-last + block - 1) / block);
+    if (first_block >= last_block) {
+        return { { l, r, n } };
+    }
+    bool capped = size_t(last_block - first_block) > max_blocks;
+    if (capped) {
+        last_block = first_block + max_blocks;
+    }
+
+    auto point = [&](int64_t i) { return anchor + i * step; };
+    std::vector<IntegralKey> segments;
+    segments.reserve(last_block - first_block + 2);
+    if (first_block * block > first) {
+        segments.push_back({ l, point(first_block * block), size_t(first_block * block - first) });
+    }
+    for (auto k = first_block; k < last_block; k++) {
+        segments.push_back({ point(k * block), point((k + 1) * block), block_n });
+    }
+    if (!capped and last > last_block * block) {
+        segments.push_back({ point(last_block * block), r, size_t(last - last_block * block) });
+    }
+    return segments;
+}
+
+IntegrationCache::IntegrationCache(size_t capacity)
+    : m_capacity(std::max<size_t>(capacity, 1))
+{}
+
+bool IntegrationCache::lookup(const IntegralKey& key, CachedIntegral& out) {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        m_misses++;
+        return false;
+    }
+    m_hits++;
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    out = it->second->second;
+    return true;
+}
+
+void IntegrationCache::insert(const IntegralKey& key, const CachedIntegral& value) {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        it->second->second = value;
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return;
+    }
+    if (m_entries.size() == m_capacity) {
+        m_index.erase(m_entries.back().first);
+        m_entries.pop_back();
+    }
+    m_entries.emplace_front(key, value);
+    m_index.emplace(key, m_entries.begin());
+}
+
+size_t IntegrationCache::getHitCount() {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    return m_hits;
+}
+
+size_t IntegrationCache::getMissCount() {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    return m_misses;
+}
+
+size_t IntegrationCache::getSize() {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    return m_entries.size();
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Integral of [l; r] with n intervals, the integrand is fixed
+struct IntegralKey {
+    double l, r;
+    size_t n;
+
+    bool operator==(const IntegralKey& other) const;
+};
+
+struct IntegralKeyHash {
+    size_t operator()(const IntegralKey& key) const;
+};
+
+struct CachedIntegral {
+    double result;
+    double error;
+    size_t evaluations;
+};
+
+// Split [l; r]/n into a head, whole blocks of block_n intervals and a tail.
+// Blocks are aligned to the grid of multiples of the step when l lies on it,
+// so overlapping requests with the same step share their blocks, and to l otherwise.
+// Past max_blocks blocks the segments stop, so they only cover a prefix of
+// [l; r]/n and the caller integrates the rest.
+std::vector<IntegralKey> alignedSegments(
+    double l, double r, size_t n, size_t block_n, size_t max_blocks
+);
+
+// Bounded cache of integrals, the least recently used one is evicted first
+class IntegrationCache {
+    using Entry = std::pair<IntegralKey, CachedIntegral>;
+
+    size_t m_capacity;
+    std::mutex m_mtx;
+    std::list<Entry> m_entries;
+    std::unordered_map<IntegralKey, std::list<Entry>::iterator, IntegralKeyHash> m_index;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+
+public:
+    explicit IntegrationCache(size_t capacity);
+
+    IntegrationCache(const IntegrationCache&) = delete;
+    IntegrationCache& operator=(const IntegrationCache&) = delete;
+
+    bool lookup(const IntegralKey& key, CachedIntegral& out);
+    void insert(const IntegralKey& key, const CachedIntegral& value);
+
+    size_t getHitCount();
+    size_t getMissCount();
+    size_t getSize();
+};
@@ -0,0 +1,220 @@
+#include "IntegrationPool.hpp"
+#include "NetworkTrace.h"
+#include "ScheduleTrapezoid.hpp"
+
+#include <cmath>
+#include <system_error>
+
+IntegrationPool::IntegrationPool(size_t n_threads, const CPUTopology& topology) {
+    // Only the ratios between the thread shares matter
+    constexpr size_t weight_scale = size_t(1) << 40;
+    auto dist = distributeWork(topology, weight_scale, std::max<size_t>(n_threads, 1));
+
+    double total_weight = 0.0;
+    for (const auto& d: dist) {
+        total_weight += std::get<1>(d);
+    }
+    double bound = 0.0;
+    for (const auto& d: dist) {
+        m_bounds.push_back(bound);
+        bound += std::get<1>(d) / total_weight;
+    }
+    m_bounds.push_back(1.0);
+
+    m_thread_rates.resize(dist.size());
+    m_thread_busy.resize(dist.size());
+    m_thread_progress.reset(new ThreadProgress[dist.size()]);
+    m_threads.reserve(dist.size());
+    try {
+        for (size_t i = 0; i < dist.size(); i++) {
+            m_threads.emplace_back(&IntegrationPool::threadLoop, this, i);
+
+            auto ids = std::get<0>(dist[i]);
+            cpu_set_t msk;
+            CPU_ZERO(&msk);
+            CPU_SET(ids.first, &msk);
+            CPU_SET(ids.second, &msk);
+            pthread_setaffinity_np(m_threads.back().native_handle(), sizeof(msk), &msk);
+        }
+    } catch (const std::system_error& e) {
+        stopThreads();
+        throw;
+    }
+}
+
+IntegrationPool::~IntegrationPool() {
+    stopThreads();
+}
+
+void IntegrationPool::stopThreads() {
+    {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_quit = true;
+    }
+    m_task_cv.notify_all();
+    for (auto& t: m_threads) {
+        t.join();
+    }
+    m_threads.clear();
+}
+
+void IntegrationPool::threadLoop(size_t thread_idx) {
+    // Every thread processes every task, in submission order
+    size_t seq = 0;
+    while (true) {
+        IntegrationTask* task = nullptr;
+        {
+            std::unique_lock<std::mutex> lck(m_mtx);
+            auto has_task = [&] { return seq - m_first_seq < m_tasks.size(); };
+            m_task_cv.wait(lck, [&] { return m_quit or has_task(); });
+            if (!has_task()) {
+                return;
+            }
+            task = m_tasks[seq - m_first_seq];
+            if (!task->m_started) {
+                task->m_started = true;
+                task->m_start = std::chrono::steady_clock::now();
+                auto q = task->m_start - task->m_submit;
+                task->queue_time =
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(q).count() / 1e9;
+                m_active++;
+            }
+            auto& progress = m_thread_progress[thread_idx];
+            progress.task = task;
+            progress.sums.store(TrapezoidEstimate());
+        }
+        seq++;
+
+        auto l = task->l;
+        auto r = task->r;
+        auto n = task->n;
+        size_t first = m_bounds[thread_idx] * n;
+        size_t last = m_bounds[thread_idx + 1] * n;
+        TrapezoidEstimate est = {};
+        auto t0 = std::chrono::steady_clock::now();
+        if (last > first) {
+            double a = l + (r - l) * first / n;
+            double b = l + (r - l) * last / n;
+            NetTraceBegin("integrate", last - first);
+            auto& sums = m_thread_progress[thread_idx].sums;
+            est = launchIntegrate(a, b, last - first, task->stop, &sums);
+            NetTraceEnd("integrate", est.evaluations);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        double d = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count() / 1e9;
+
+        std::lock_guard<std::mutex> lck(m_mtx);
+        // From now on the sums are counted in the task itself
+        m_thread_progress[thread_idx].task = nullptr;
+        m_thread_busy[thread_idx] += d;
+        if (est.evaluations and d > 0.0) {
+            auto& rate = m_thread_rates[thread_idx];
+            double sample = est.evaluations / d;
+            double alpha = rate ? 1.0 - std::exp(-d / rate_time_constant_s): 1.0;
+            rate += alpha * (sample - rate);
+        }
+        task->result += est.s;
+        task->error += est.error;
+        // Neighbouring threads share their boundary point
+        task->evaluations += est.evaluations - (task->evaluations and est.evaluations ? 1: 0);
+        if (last > first and est.evaluations < last - first + 1) {
+            task->stopped = true;
+        }
+        if (--task->m_remaining == 0) {
+            auto t = std::chrono::steady_clock::now() - task->m_start;
+            task->compute_time =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(t).count() / 1e9;
+            task->m_done = true;
+            m_active--;
+            // A task is only finished after all threads are done with all
+            // previous ones, so finished tasks are always at the front
+            while (!m_tasks.empty() and m_tasks.front()->m_done) {
+                m_tasks.pop_front();
+                m_first_seq++;
+            }
+            m_done_cv.notify_all();
+        }
+    }
+}
+
+void IntegrationPool::submit(IntegrationTask& task) {
+    {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        task.result = 0.0;
+        task.error = 0.0;
+        task.evaluations = 0;
+        task.queue_time = 0.0;
+        task.compute_time = 0.0;
+        task.stopped = false;
+        task.m_submit = std::chrono::steady_clock::now();
+        task.m_remaining = m_threads.size();
+        task.m_started = false;
+        task.m_done = false;
+        m_tasks.push_back(&task);
+    }
+    m_task_cv.notify_all();
+}
+
+void IntegrationPool::wait(IntegrationTask& task) {
+    std::unique_lock<std::mutex> lck(m_mtx);
+    m_done_cv.wait(lck, [&] { return task.m_done; });
+}
+
+bool IntegrationPool::wait(IntegrationTask& task, std::chrono::steady_clock::duration timeout) {
+    std::unique_lock<std::mutex> lck(m_mtx);
+    return m_done_cv.wait_for(lck, timeout, [&] { return task.m_done; });
+}
+
+double IntegrationPool::integrate(double l, double r, size_t n) {
+    IntegrationTask task;
+    task.l = l;
+    task.r = r;
+    task.n = n;
+    submit(task);
+    wait(task);
+    return task.result;
+}
+
+TrapezoidEstimate IntegrationPool::getProgress(const IntegrationTask& task) const {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    TrapezoidEstimate est = { task.result, task.error, task.evaluations };
+    if (task.m_done) {
+        return est;
+    }
+    for (size_t i = 0; i < m_threads.size(); i++) {
+        const auto& progress = m_thread_progress[i];
+        if (progress.task != &task) {
+            continue;
+        }
+        auto part = progress.sums.load();
+        est.s += part.s;
+        est.error += part.error;
+        // Neighbouring threads share their boundary point
+        est.evaluations += part.evaluations - (est.evaluations and part.evaluations ? 1: 0);
+    }
+    return est;
+}
+
+double IntegrationPool::getThroughput() const {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    double throughput = 0.0;
+    for (auto rate: m_thread_rates) {
+        throughput += rate;
+    }
+    return throughput;
+}
+
+size_t IntegrationPool::getQueuedCount() const {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    return m_tasks.size() - m_active;
+}
+
+size_t IntegrationPool::getActiveCount() const {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    return m_active;
+}
+
+std::vector<double> IntegrationPool::getThreadBusyTimes() const {
+    std::lock_guard<std::mutex> lck(m_mtx);
+    return m_thread_busy;
+}
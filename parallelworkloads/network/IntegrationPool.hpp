@@ -0,0 +1,105 @@
+#pragma once
+#include "CPUTopology.hpp"
+#include "ScheduleTrapezoid.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct IntegrationTask {
+    double l, r;
+    size_t n;
+    // Checked by every thread between chunks of its share
+    StopCondition stop;
+
+    double result = 0.0;
+    double error = 0.0;
+    size_t evaluations = 0;
+    // Time from submit to the first thread starting the task
+    double queue_time = 0.0;
+    // Time from the first thread starting the task to the last one finishing it
+    double compute_time = 0.0;
+    // The stop condition was reached before all points were integrated
+    bool stopped = false;
+
+private:
+    friend class IntegrationPool;
+    size_t m_remaining = 0;
+    bool m_started = false;
+    bool m_done = false;
+    std::chrono::steady_clock::time_point m_submit;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Long-lived set of pinned threads that integrate submitted tasks.
+// Every task is split between all threads according to distributeWork,
+// so submitting only costs pushing the task onto a queue.
+class IntegrationPool {
+    std::vector<std::thread> m_threads;
+    // Fraction of each task's points that precede thread i's share
+    std::vector<double> m_bounds;
+
+    mutable std::mutex m_mtx;
+    std::condition_variable m_task_cv;
+    std::condition_variable m_done_cv;
+    std::deque<IntegrationTask*> m_tasks;
+    // Sequence number of m_tasks.front()
+    size_t m_first_seq = 0;
+    // Number of tasks in m_tasks that some thread has started
+    size_t m_active = 0;
+    bool m_quit = false;
+
+    // Exponentially weighted evaluations per second of each thread,
+    // a sample's weight grows with the time it took
+    std::vector<double> m_thread_rates;
+    static constexpr double rate_time_constant_s = 10.0;
+    // Seconds each thread has spent integrating
+    std::vector<double> m_thread_busy;
+
+    // The task each thread is integrating and its sums so far.
+    // task is only changed under m_mtx, the sums are updated without it.
+    struct ThreadProgress {
+        const IntegrationTask* task = nullptr;
+        IntegrationProgress sums;
+    };
+    std::unique_ptr<ThreadProgress[]> m_thread_progress;
+
+    void threadLoop(size_t thread_idx);
+    void stopThreads();
+
+public:
+    IntegrationPool(size_t n_threads, const CPUTopology& topology);
+    ~IntegrationPool();
+
+    IntegrationPool(const IntegrationPool&) = delete;
+    IntegrationPool& operator=(const IntegrationPool&) = delete;
+
+    size_t getThreadCount() const {
+        return m_threads.size();
+    }
+
+    // The task must stay alive until wait returns
+    void submit(IntegrationTask& task);
+    void wait(IntegrationTask& task);
+    // Returns false if the task is still running after timeout
+    bool wait(IntegrationTask& task, std::chrono::steady_clock::duration timeout);
+
+    double integrate(double l, double r, size_t n);
+
+    // Sums of the points of a submitted task integrated so far, including
+    // the chunks that running threads have finished. Zero if it is not started.
+    TrapezoidEstimate getProgress(const IntegrationTask& task) const;
+
+    // Evaluations per second measured on recent tasks
+    double getThroughput() const;
+    // Number of tasks that no thread has started yet
+    size_t getQueuedCount() const;
+    // Number of tasks that are being computed
+    size_t getActiveCount() const;
+    // Seconds each thread has spent integrating since the pool started
+    std::vector<double> getThreadBusyTimes() const;
+};
@@ -0,0 +1,160 @@
+// This program measures TrapezoidServer throughput and latency under load:
+// a number of simulated clients send requests either back to back
+// (closed loop) or at a fixed total arrival rate (open loop).
+//
+// Usage: LoadGenerator [-c clients] [-n points] [-b batch] [-r rate] [-d seconds] [-s]
+//   -r   total requests per second over all clients, 0 for closed loop
+//   -s   send the same request every time, so the server can answer from its cache
+#include "NetworkClient.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+struct Options {
+    size_t clients = 4;
+    size_t n = 1000 * 1000;
+    size_t batch = 1;
+    double rate = 0.0;
+    double duration_s = 10.0;
+    bool same_request = false;
+};
+
+struct ClientResult {
+    std::vector<double> latencies;
+    size_t failed = 0;
+};
+
+double Seconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1e9;
+}
+
+// In open loop latency counts from when a request was due, not from when it
+// was sent, so a slow server cannot hide its backlog by delaying the clients
+void RunClient(const Options& opts, size_t idx, std::chrono::steady_clock::time_point end, ClientResult& result) {
+    std::mt19937_64 rng(idx);
+    std::uniform_real_distribution<double> offset(0.0, 1.0);
+    std::exponential_distribution<double> interarrival(opts.rate > 0.0 ? opts.rate / opts.clients: 1.0);
+
+    std::vector<IntegrationRequest> ireqs(opts.batch);
+    std::vector<IntegrationResponse> iresps(opts.batch);
+    auto due = std::chrono::steady_clock::now();
+    while (true) {
+        if (opts.rate > 0.0) {
+            due += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(interarrival(rng))
+            );
+            std::this_thread::sleep_until(due);
+        } else {
+            due = std::chrono::steady_clock::now();
+        }
+        if (due >= end) {
+            return;
+        }
+
+        for (auto& ireq: ireqs) {
+            // Ranges that start off the grid of any earlier request never hit the cache
+            double l = opts.same_request ? 0.0: offset(rng);
+            ireq = { l, l + opts.n / 1000.0, opts.n, 0.0 };
+        }
+        if (ClientSendBatch(ireqs.data(), ireqs.size(), iresps.data())) {
+            result.failed++;
+        } else {
+            result.latencies.push_back(Seconds(std::chrono::steady_clock::now() - due));
+        }
+    }
+}
+
+double Percentile(const std::vector<double>& sorted, double q) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t idx = std::ceil(q * sorted.size());
+    return sorted[std::min(std::max<size_t>(idx, 1), sorted.size()) - 1];
+}
+}
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:b:r:d:s")) != -1) {
+        switch (opt) {
+        case 'c':
+            opts.clients = std::max(1ull, strtoull(optarg, nullptr, 10));
+            break;
+        case 'n':
+            opts.n = std::max(1ull, strtoull(optarg, nullptr, 10));
+            break;
+        case 'b':
+            opts.batch = std::min<size_t>(std::max(1ull, strtoull(optarg, nullptr, 10)), MAX_FRAME_RECORDS);
+            break;
+        case 'r':
+            opts.rate = strtod(optarg, nullptr);
+            break;
+        case 'd':
+            opts.duration_s = strtod(optarg, nullptr);
+            break;
+        case 's':
+            opts.same_request = true;
+            break;
+        default:
+            std::cerr << "Usage: LoadGenerator [-c clients] [-n points] [-b batch] [-r rate] [-d seconds] [-s]\n";
+            return -1;
+        }
+    }
+
+    // Find the workers before the clock starts
+    if (ClientGetThroughput() == 0.0) {
+        std::cerr << "Failed to find any workers\n";
+        return -1;
+    }
+
+    std::vector<ClientResult> results(opts.clients);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(opts.duration_s)
+    );
+    for (size_t i = 0; i < opts.clients; i++) {
+        threads.emplace_back(RunClient, std::cref(opts), i, end, std::ref(results[i]));
+    }
+    for (auto& t: threads) {
+        t.join();
+    }
+    double elapsed = Seconds(std::chrono::steady_clock::now() - start);
+
+    std::vector<double> latencies;
+    size_t failed = 0;
+    for (const auto& r: results) {
+        latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+        failed += r.failed;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("mode          %s\n", opts.rate > 0.0 ? "open loop": "closed loop");
+    printf("clients       %zu\n", opts.clients);
+    printf("batch         %zu x %zu points\n", opts.batch, opts.n);
+    printf("completed     %zu\n", latencies.size());
+    printf("failed        %zu\n", failed);
+    printf("elapsed_s     %.3f\n", elapsed);
+    printf("batches/s     %.1f\n", latencies.size() / elapsed);
+    printf("points/s      %.0f\n", latencies.size() * opts.batch * double(opts.n) / elapsed);
+    static const std::pair<const char*, double> percentiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 },
+    };
+    for (const auto& p: percentiles) {
+        printf("%-13s %.3f ms\n", p.first, Percentile(latencies, p.second) * 1e3);
+    }
+    printf("%-13s %.3f ms\n", "max", latencies.empty() ? 0.0: latencies.back() * 1e3);
+    return failed ? 1: 0;
+}
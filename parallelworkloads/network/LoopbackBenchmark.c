@@ -0,0 +1,205 @@
+// This program measures how many frames per second can be sent over a
+// loopback TCP connection with sendAll, sendAllv and sendAllm
+#define _GNU_SOURCE
+#include "NetworkCommon.h"
+
+#include <arpa/inet.h>
+#include <iso646.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    Socket  socket;
+    size_t  total_sz;
+    int     r;
+} DrainData;
+
+static void* Drain(void* p) {
+    DrainData* dd = p;
+    enum { DRAIN_BUFFER_SIZE = 1 << 16 };
+    static char buf[DRAIN_BUFFER_SIZE];
+    size_t left = dd->total_sz;
+    while (left) {
+        size_t sz = left < sizeof(buf) ? left: sizeof(buf);
+        recvAll(dd->socket, buf, &sz);
+        if (!sz) {
+            dd->r = -1;
+            return NULL;
+        }
+        left -= sz;
+    }
+    dd->r = 0;
+    return NULL;
+}
+
+static int ConnectLoopback(Socket* send_out, Socket* recv_out) {
+    struct sockaddr_in ai = {
+        .sin_addr = {
+            .s_addr = htonl(INADDR_LOOPBACK),
+        },
+        .sin_family = AF_INET,
+    };
+    socklen_t ai_sz = sizeof(ai);
+
+    Socket l = socket(PF_INET, SOCK_STREAM, 0);
+    if (l == -1) {
+        return -1;
+    }
+    if (bind(l, (const void*) &ai, sizeof(ai)) or
+        listen(l, 1) or
+        getsockname(l, (void*) &ai, &ai_sz)
+    ) {
+        close(l);
+        return -1;
+    }
+
+    Socket s = socket(PF_INET, SOCK_STREAM, 0);
+    if (s == -1 or connect(s, (const void*) &ai, sizeof(ai))) {
+        close(s);
+        close(l);
+        return -1;
+    }
+    Socket r = accept(l, NULL, NULL);
+    close(l);
+    if (r == -1) {
+        close(s);
+        return -1;
+    }
+
+    *send_out = s;
+    *recv_out = r;
+    return 0;
+}
+
+typedef enum {
+    MODE_SEND_ALL,
+    MODE_SEND_ALLV,
+    MODE_SEND_ALLM,
+} SendMode;
+
+static const char* mode_names[] = {
+    "sendAll x2",
+    "sendAllv",
+    "sendAllm",
+};
+
+enum { BATCH_SIZE = 64 };
+
+// Every message is a frame header followed by its records
+static int SendMessages(
+    Socket s, SendMode mode, unsigned char* hdr, unsigned char* records,
+    size_t records_sz, size_t msg_cnt
+) {
+    size_t msg_sz = FRAME_HEADER_SIZE + records_sz;
+    struct iovec iovs[2 * BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE];
+    for (size_t i = 0; i < msg_cnt;) {
+        size_t sz;
+        switch (mode) {
+        case MODE_SEND_ALL:
+            sz = FRAME_HEADER_SIZE;
+            sendAll(s, hdr, &sz);
+            if (sz != FRAME_HEADER_SIZE) {
+                return -1;
+            }
+            sz = records_sz;
+            sendAll(s, records, &sz);
+            if (sz != records_sz) {
+                return -1;
+            }
+            i++;
+            break;
+        case MODE_SEND_ALLV:
+            iovs[0] = (struct iovec) { hdr, FRAME_HEADER_SIZE };
+            iovs[1] = (struct iovec) { records, records_sz };
+            sendAllv(s, iovs, 2, &sz);
+            if (sz != msg_sz) {
+                return -1;
+            }
+            i++;
+            break;
+        case MODE_SEND_ALLM: {
+            size_t batch = msg_cnt - i < BATCH_SIZE ? msg_cnt - i: BATCH_SIZE;
+            for (size_t k = 0; k < batch; k++) {
+                iovs[2 * k]     = (struct iovec) { hdr, FRAME_HEADER_SIZE };
+                iovs[2 * k + 1] = (struct iovec) { records, records_sz };
+                msgs[k] = (struct mmsghdr) {
+                    .msg_hdr = {
+                        .msg_iov = &iovs[2 * k],
+                        .msg_iovlen = 2,
+                    },
+                };
+            }
+            sendAllm(s, msgs, batch, &sz);
+            if (sz != batch) {
+                return -1;
+            }
+            i += batch;
+            break;
+        }
+        }
+    }
+    return 0;
+}
+
+static int RunBenchmark(SendMode mode, size_t records_sz, size_t msg_cnt, double* rate_out) {
+    Socket s, r;
+    if (ConnectLoopback(&s, &r)) {
+        perror("Failed to connect over loopback");
+        return -1;
+    }
+
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    encodeFrameHeader(FRAME_INTEGRATION_RESPONSE, records_sz / INTEGRATION_RESPONSE_SIZE, hdr);
+    unsigned char* records = calloc(records_sz + 1, 1);
+
+    DrainData dd = {
+        .socket = r,
+        .total_sz = (FRAME_HEADER_SIZE + records_sz) * msg_cnt,
+    };
+    pthread_t drain;
+    int ret = -1;
+    if (records and !pthread_create(&drain, NULL, Drain, &dd)) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ret = SendMessages(s, mode, hdr, records, records_sz, msg_cnt);
+        if (ret) {
+            shutdown(s, SHUT_RDWR);
+        }
+        pthread_join(drain, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ret = ret ? ret: dd.r;
+        double d = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        *rate_out = msg_cnt / d;
+    }
+
+    free(records);
+    close(s);
+    close(r);
+    return ret;
+}
+
+int main(int argc, const char* argv[]) {
+    size_t msg_cnt = 1000 * 1000;
+    if (argc > 1) {
+        msg_cnt = strtoull(argv[1], NULL, 10);
+    }
+
+    static const size_t record_counts[] = { 1, 16, 256 };
+    printf("%-12s %10s %16s\n", "mode", "records", "messages/s");
+    for (size_t k = 0; k < sizeof(record_counts) / sizeof(*record_counts); k++) {
+        size_t records_sz = record_counts[k] * INTEGRATION_RESPONSE_SIZE;
+        for (SendMode mode = MODE_SEND_ALL; mode <= MODE_SEND_ALLM; mode++) {
+            double rate;
+            if (RunBenchmark(mode, records_sz, msg_cnt, &rate)) {
+                fprintf(stderr, "Benchmark %s failed\n", mode_names[mode]);
+                return -1;
+            }
+            printf("%-12s %10zu %16.0f\n", mode_names[mode], record_counts[k], rate);
+        }
+    }
+}
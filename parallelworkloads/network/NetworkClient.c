@@ -2,9 +2,14 @@
 #include "NetworkClient.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <iso646.h>
+#include <math.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -13,6 +18,8 @@
 typedef struct {
     struct sockaddr_in  addr;
     WorkerProperties    props;
+    // When the worker last answered a discovery request
+    struct timespec     last_seen;
 } WorkerInfo;
 
 typedef struct {
@@ -20,21 +27,91 @@ typedef struct {
     size_t      worker_count;
 } WorkersInfo;
 
+// Workers found by the discovery thread, which keeps rebroadcasting
+// discovery requests so that ClientSend never waits for discovery
+// once any worker is known
 typedef struct {
-    Socket              socket;
-    WorkerProperties    props;
-} WorkerConnection;
+    pthread_mutex_t mtx;
+    // Signalled when a new worker is found
+    pthread_cond_t  cond;
+    WorkerInfo*     workers;
+    size_t          worker_count;
+    size_t          worker_capacity;
+} WorkerRegistry;
+
+static WorkerRegistry registry = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+static double TimespecDiff(const struct timespec* end, const struct timespec* start) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
 
-static int GetWorkersForSocket(
-    Socket s, unsigned short discover_port, WorkersInfo* pinfo
-) {
-    NetDebugPrint("Enable broadcast for socket %d\n", s);
-    int broadcast = 1;
-    if (setsockopt(s, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast))) {
-        NetDebugPrint("Failed to enable broadcast\n");
-        return -1;
+static struct timespec TimespecAdd(struct timespec t, double d) {
+    long long ns = t.tv_nsec + (long long)(d * 1e9);
+    t.tv_sec += ns / (long long)1e9;
+    t.tv_nsec = ns % (long long)1e9;
+    return t;
+}
+
+static bool SameWorker(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr and a->sin_port == b->sin_port;
+}
+
+// Must be called with the registry locked
+static int RegistryUpdate(const WorkerInfo* info) {
+    for (size_t i = 0; i < registry.worker_count; i++) {
+        if (SameWorker(&registry.workers[i].addr, &info->addr)) {
+            registry.workers[i] = *info;
+            return 0;
+        }
+    }
+
+    if (registry.worker_count == registry.worker_capacity) {
+        size_t capacity = registry.worker_capacity ? 2 * registry.worker_capacity: 8;
+        void* new_workers = realloc(registry.workers, capacity * sizeof(*registry.workers));
+        if (!new_workers) {
+            NetDebugPrint("Allocation error\n");
+            return -1;
+        }
+        registry.workers = new_workers;
+        registry.worker_capacity = capacity;
+    }
+    registry.workers[registry.worker_count++] = *info;
+
+    char buf[16];
+    inet_ntop(AF_INET, &info->addr.sin_addr, buf, sizeof(buf));
+    NetDebugPrint("Found worker at %s:%hu with %u threads and throughput %.0f/s\n",
+        buf, ntohs(info->addr.sin_port), info->props.thread_count, info->props.throughput);
+    pthread_cond_broadcast(&registry.cond);
+    return 0;
+}
+
+// Must be called with the registry locked
+static void RegistryRemove(const struct sockaddr_in* addr) {
+    for (size_t i = 0; i < registry.worker_count; i++) {
+        if (SameWorker(&registry.workers[i].addr, addr)) {
+            registry.workers[i] = registry.workers[--registry.worker_count];
+            return;
+        }
     }
+}
 
+// Must be called with the registry locked
+static void RegistryExpire(const struct timespec* now) {
+    for (size_t i = 0; i < registry.worker_count;) {
+        if (TimespecDiff(now, &registry.workers[i].last_seen) > CLIENT_WORKER_EXPIRY_S) {
+            NetDebugPrint("Worker %zu has not answered discovery, forget it\n", i);
+            registry.workers[i] = registry.workers[--registry.worker_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+static int BroadcastDiscoveryRequest(Socket s, unsigned short discover_port) {
     struct sockaddr_in ai = {
         .sin_addr = {
             .s_addr = INADDR_BROADCAST,
@@ -43,216 +120,648 @@ static int GetWorkersForSocket(
         .sin_port = htons(discover_port),
     };
 
-    DiscoveryRequestPacket dreq = {
-        .magic = MAGIC_V,
-    };
-    ssize_t sz = sendto(s, &dreq, sizeof(dreq), 0, (const void*) &ai, sizeof(ai));
+    unsigned char dreq[FRAME_HEADER_SIZE];
+    encodeFrameHeader(FRAME_DISCOVERY_REQUEST, 0, dreq);
+    ssize_t sz = sendto(s, dreq, sizeof(dreq), 0, (const void*) &ai, sizeof(ai));
     if (sz != sizeof(dreq)) {
         NetDebugPrint("Failed to broadcast discovery request\n");
         return -1;
     }
+    return 0;
+}
 
-    static const long long total_timeout_ns =
-        CLIENT_PEER_DISCOVERY_TIMEOUT_S * 1e9;
-    long long timeout_ns = total_timeout_ns;
-    NetDebugPrint("Total discovery time: %.3fs\n", total_timeout_ns / 1e9);
-
-    struct timespec start, end;
-    if (clock_gettime(CLOCK_REALTIME, &start)) {
-        NetDebugPrint("Failed to set discovery start time\n");
-        return -1;
-    }
-
-    while(timeout_ns > 0) {
-        socklen_t addr_sz = sizeof(*pinfo->workers);
-        void* new_workers = realloc(pinfo->workers, addr_sz * (pinfo->worker_count + 1));
-        if (!new_workers) {
-            NetDebugPrint("Allocation error\n");
-            return -1;
+// Collect discovery responses until the deadline
+static void RecieveDiscoveryResponses(Socket s, const struct timespec* deadline) {
+    enum { DISCOVERY_BATCH = 16 };
+    unsigned char dresps[DISCOVERY_BATCH][FRAME_HEADER_SIZE + DISCOVERY_RESPONSE_SIZE];
+    struct sockaddr_in addrs[DISCOVERY_BATCH];
+    struct iovec iovs[DISCOVERY_BATCH];
+    struct mmsghdr msgs[DISCOVERY_BATCH];
+
+    while (true) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double timeout = TimespecDiff(deadline, &now);
+        if (timeout <= 0) {
+            return;
         }
-        pinfo->workers = new_workers;
-        WorkerInfo* back = &pinfo->workers[pinfo->worker_count];
-
-        struct timeval wait_time = {};
-        wait_time.tv_sec = timeout_ns / (long long)1e9;
-        wait_time.tv_usec = (timeout_ns - wait_time.tv_sec * (long long)1e9) / (long long) 1e3;
-        NetDebugPrint("Set discovery timeout to %lds %ldus\n", wait_time.tv_sec, wait_time.tv_usec);
+        struct timeval wait_time = {
+            .tv_sec = timeout,
+            .tv_usec = (timeout - wait_time.tv_sec) * 1e6 + 1,
+        };
         if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &wait_time, sizeof(wait_time))) {
             NetDebugPrint("Failed to set timeout\n");
-            goto cont;
-        }
-
-        DiscoveryResponsePacket dresp;
-        NetDebugPrint("Recieve discovery broadcast response\n");
-        ssize_t sz = recvfrom(s, &dresp, sizeof(dresp), 0, &back->addr, &addr_sz);
-        if (sz != sizeof(dresp)) {
-            NetDebugPrint("Failed to recieve response\n");
-            goto cont;
-        } else if (dresp.magic != MAGIC_V) {
-            NetDebugPrint("Wrong magic number\n");
-            goto cont;
-        }
-        back->props = dresp.response.props;
-        for (size_t i = 0; i < pinfo->worker_count; i++) {
-            if (memcmp(&pinfo->workers[i], back, addr_sz) == 0) {
-                NetDebugPrint("Duplicate\n");
-                goto cont;
-            }
+            return;
         }
-        NetDebugPrint("Recieved response\n");
-        pinfo->worker_count++;
 
-cont:
-        if (clock_gettime(CLOCK_REALTIME, &end)) {
-            NetDebugPrint("Failed to get current time\n");
-            return -1;
+        for (size_t i = 0; i < DISCOVERY_BATCH; i++) {
+            iovs[i] = (struct iovec) { dresps[i], sizeof(dresps[i]) };
+            msgs[i] = (struct mmsghdr) {
+                .msg_hdr = {
+                    .msg_name = &addrs[i],
+                    .msg_namelen = sizeof(addrs[i]),
+                    .msg_iov = &iovs[i],
+                    .msg_iovlen = 1,
+                },
+            };
         }
-        long long delta_ns =
-            (end.tv_sec - start.tv_sec) * (long long)1e9 +
-            end.tv_nsec - start.tv_nsec;
-        timeout_ns -= delta_ns;
+        // Return as soon as there is at least one response
+        int cnt = recvmmsg(s, msgs, DISCOVERY_BATCH, MSG_WAITFORONE, NULL);
+        if (cnt <= 0) {
+            if (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR) {
+                NetDebugPrint("Failed to recieve discovery responses\n");
+                return;
+            }
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pthread_mutex_lock(&registry.mtx);
+        for (int i = 0; i < cnt; i++) {
+            FrameHeader hdr;
+            DiscoveryResponse response;
+            if (msgs[i].msg_len != sizeof(dresps[i])) {
+                NetDebugPrint("Wrong discovery response size %u\n", msgs[i].msg_len);
+                continue;
+            } else if (decodeFrameHeader(dresps[i], FRAME_DISCOVERY_RESPONSE, &hdr) or hdr.count != 1) {
+                continue;
+            }
+            decodeDiscoveryResponse(dresps[i] + FRAME_HEADER_SIZE, &response);
+            WorkerInfo info = {
+                .addr = addrs[i],
+                .props = response.props,
+                .last_seen = now,
+            };
+            // Every server instance on a host is a separate worker
+            info.addr.sin_port = htons(response.port);
+            NetTraceInstant("discovery_response", response.instance);
+            RegistryUpdate(&info);
+        }
+        pthread_mutex_unlock(&registry.mtx);
     }
+}
 
-    return 0;
+static void* DiscoveryLoop(void* p) {
+    Socket s = (Socket)(intptr_t)p;
+    while (true) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        NetDebugPrint("Broadcast discovery request\n");
+        NetTraceInstant("discovery_broadcast", 0);
+        BroadcastDiscoveryRequest(s, DISCOVER_PORT_V);
+        struct timespec deadline = TimespecAdd(start, CLIENT_DISCOVERY_PERIOD_S);
+        RecieveDiscoveryResponses(s, &deadline);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&registry.mtx);
+        RegistryExpire(&now);
+        pthread_mutex_unlock(&registry.mtx);
+    }
+    return NULL;
 }
 
-static int GetWorkers(unsigned short discover_port, WorkersInfo* pinfo
-) {
+static void StartRegistry(void) {
     Socket s = socket(PF_INET, SOCK_DGRAM, 0);
     if (s == -1) {
         NetDebugPrint("Failed to create broadcast socket\n");
-        return -1;
+        return;
+    }
+    NetDebugPrint("Enable broadcast for socket %d\n", s);
+    int broadcast = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast))) {
+        NetDebugPrint("Failed to enable broadcast\n");
+        close(s);
+        return;
     }
-    pinfo->workers = NULL;
-    pinfo->worker_count = 0;
-    int r = GetWorkersForSocket(s, discover_port, pinfo);
-    close(s);
-    if (r) {
-        free(pinfo->workers);
+    pthread_t t;
+    if (pthread_create(&t, NULL, DiscoveryLoop, (void*)(intptr_t)s)) {
+        NetDebugPrint("Failed to start discovery thread\n");
+        close(s);
+        return;
     }
+    pthread_detach(t);
+}
+
+// Copy the known workers. If none are known yet, wait for the first one
+// to answer and then a little longer for the others that answer together with it.
+static int GetWorkers(WorkersInfo* pinfo) {
+    pthread_once(&registry_once, StartRegistry);
+
+    pthread_mutex_lock(&registry.mtx);
+    NetTraceBegin("get_workers", registry.worker_count);
+    if (!registry.worker_count) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        struct timespec deadline = TimespecAdd(now, CLIENT_PEER_DISCOVERY_TIMEOUT_S);
+        NetDebugPrint("Wait for the first worker\n");
+        while (!registry.worker_count) {
+            if (pthread_cond_timedwait(&registry.cond, &registry.mtx, &deadline)) {
+                break;
+            }
+        }
+        if (registry.worker_count) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            struct timespec grace = TimespecAdd(now, CLIENT_PEER_DISCOVERY_GRACE_S);
+            if (TimespecDiff(&grace, &deadline) > 0) {
+                grace = deadline;
+            }
+            while (!pthread_cond_timedwait(&registry.cond, &registry.mtx, &grace)) {}
+        }
+    }
+
+    int r = 0;
+    pinfo->worker_count = registry.worker_count;
+    pinfo->workers = calloc(pinfo->worker_count + 1, sizeof(*pinfo->workers));
+    if (pinfo->workers) {
+        memcpy(pinfo->workers, registry.workers, pinfo->worker_count * sizeof(*pinfo->workers));
+    } else {
+        NetDebugPrint("Allocation error\n");
+        r = -1;
+    }
+    NetTraceEnd("get_workers", pinfo->worker_count);
+    pthread_mutex_unlock(&registry.mtx);
+
     return r;
 }
 
-static int SendAndRecieve(
-    Socket s,
-    const IntegrationRequest* ireq,
-    IntegrationResponse* iresp_out
-) {
-    IntegrationRequestPacket ireqp = {
-        .magic = MAGIC_V,
-        .request = *ireq,
-    };
-    size_t send_sz = sizeof(ireqp);
-    NetDebugPrint("Send request to socket %d\n", s);
-    sendAll(s, &ireqp, &send_sz);
-    NetDebugPrint("Sent %zu/%zu bytes to socket %d\n", send_sz, sizeof(ireqp), s);
-    if (send_sz != sizeof(ireqp)) {
-        return -1;
+// Drop a worker that could not be reached until it answers discovery again
+static void ForgetWorker(const struct sockaddr_in* addr) {
+    pthread_mutex_lock(&registry.mtx);
+    RegistryRemove(addr);
+    pthread_mutex_unlock(&registry.mtx);
+}
+
+typedef enum {
+    CONNECTION_CONNECTING,
+    // Connected, but nothing to send yet
+    CONNECTION_IDLE,
+    CONNECTION_SENDING,
+    CONNECTION_RECIEVING_HEADER,
+    CONNECTION_RECIEVING_RECORDS,
+    CONNECTION_DONE,
+    CONNECTION_FAILED,
+} ConnectionState;
+
+// Non-blocking connection to a worker, driven by RunConnections
+typedef struct {
+    Socket              socket;
+    struct sockaddr_in  addr;
+    WorkerProperties    props;
+    ConnectionState     state;
+    struct timespec     deadline;
+
+    // Pieces of the batch scheduled to this worker
+    IntegrationRequest*  ireqs;
+    IntegrationResponse* iresps;
+    // Which request of the batch each piece belongs to
+    size_t*              origins;
+    size_t               count;
+    double               load;
+    // Ask for progress frames, progressed is set when one arrives
+    bool                 stream;
+    bool                 progressed;
+
+    // Frame that is being sent or records that are being received
+    unsigned char*  buf;
+    size_t          buf_sz;
+    size_t          done_sz;
+    unsigned char   hdr[FRAME_HEADER_SIZE];
+    FrameType       frame_type;
+} WorkerConnection;
+
+static bool IsWaiting(ConnectionState state) {
+    return state != CONNECTION_IDLE and
+           state != CONNECTION_DONE and
+           state != CONNECTION_FAILED;
+}
+
+static void FailConnection(WorkerConnection* con) {
+    NetDebugPrint("Connection on socket %d failed in state %d\n", con->socket, con->state);
+    if (con->state == CONNECTION_CONNECTING) {
+        ForgetWorker(&con->addr);
     }
+    con->state = CONNECTION_FAILED;
+    free(con->buf);
+    con->buf = NULL;
+}
 
-    IntegrationResponsePacket irespp;
-    size_t rcv_sz = sizeof(irespp);
-    NetDebugPrint("Receive response from socket %d\n", s);
-    recvAll(s, &irespp, &rcv_sz);
-    NetDebugPrint("Received %zu/%zu bytes from socket %d\n", rcv_sz, sizeof(irespp), s);
-    if (rcv_sz != sizeof(irespp)) {
+static void StartConnection(WorkerConnection* con) {
+    Socket s = con->socket = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s == -1) {
+        NetDebugPrint("Failed to create socket\n");
+        con->state = CONNECTION_FAILED;
+        return;
+    }
+    con->state = CONNECTION_CONNECTING;
+    NetTraceInstant("connect", s);
+    if (!connect(s, (const void*) &con->addr, sizeof(con->addr))) {
+        NetDebugPrint("Connected to socket %d\n", s);
+        con->state = CONNECTION_IDLE;
+    } else if (errno != EINPROGRESS) {
+        NetDebugPrint("Failed to connect to socket %d\n", s);
+        FailConnection(con);
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &con->deadline);
+        con->deadline = TimespecAdd(con->deadline, CLIENT_PEER_CONNECT_TIMEOUT_S);
+    }
+}
+
+// Queue the connection's pieces as a request frame
+static int StartSending(WorkerConnection* con) {
+    size_t records_sz = con->count * INTEGRATION_REQUEST_SIZE;
+    con->buf_sz = FRAME_HEADER_SIZE + records_sz;
+    con->buf = malloc(con->buf_sz);
+    if (!con->buf) {
+        NetDebugPrint("Allocation error\n");
+        FailConnection(con);
         return -1;
-    } else if (irespp.magic != MAGIC_V) {
-        NetDebugPrint("Wrong magic number for socket %d\n", s);
+    }
+    // Without progress frames we give up on the worker after
+    // CLIENT_PEER_RECIEVE_TIMEOUT_S, so it need not go on any longer either
+    for (size_t k = 0; k < con->count and !con->stream; k++) {
+        double* timeout = &con->ireqs[k].timeout;
+        if (!*timeout or *timeout > CLIENT_PEER_RECIEVE_TIMEOUT_S) {
+            *timeout = CLIENT_PEER_RECIEVE_TIMEOUT_S;
+        }
+    }
+    FrameType type = con->stream ? FRAME_INTEGRATION_STREAM_REQUEST: FRAME_INTEGRATION_REQUEST;
+    encodeFrameHeader(type, con->count, con->buf);
+    encodeIntegrationRequests(con->ireqs, con->count, con->buf + FRAME_HEADER_SIZE);
+    con->done_sz = 0;
+    con->state = CONNECTION_SENDING;
+    clock_gettime(CLOCK_MONOTONIC, &con->deadline);
+    con->deadline = TimespecAdd(con->deadline, CLIENT_PEER_RECIEVE_TIMEOUT_S);
+    NetDebugPrint("Send %zu requests to socket %d\n", con->count, con->socket);
+    return 0;
+}
+
+// Make as much progress as the socket allows without blocking
+static void StepConnection(WorkerConnection* con) {
+    Socket s = con->socket;
+    ssize_t sz;
+    switch (con->state) {
+    case CONNECTION_CONNECTING: {
+        int err = 0;
+        socklen_t err_sz = sizeof(err);
+        if (getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &err_sz) or err) {
+            NetDebugPrint("Failed to connect to socket %d\n", s);
+            FailConnection(con);
+            return;
+        }
+        NetDebugPrint("Connected to socket %d\n", s);
+        con->state = CONNECTION_IDLE;
+        return;
+    }
+    case CONNECTION_SENDING:
+        sz = send(s, con->buf + con->done_sz, con->buf_sz - con->done_sz, MSG_NOSIGNAL);
+        if (sz < 0) {
+            if (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR) {
+                FailConnection(con);
+            }
+            return;
+        }
+        con->done_sz += sz;
+        NetTraceInstant("send", sz);
+        NetDebugPrint("Sent %zu/%zu bytes to socket %d\n", con->done_sz, con->buf_sz, s);
+        if (con->done_sz == con->buf_sz) {
+            free(con->buf);
+            con->buf = NULL;
+            con->done_sz = 0;
+            con->state = CONNECTION_RECIEVING_HEADER;
+        }
+        return;
+    case CONNECTION_RECIEVING_HEADER: {
+        sz = recv(s, con->hdr + con->done_sz, FRAME_HEADER_SIZE - con->done_sz, 0);
+        if (sz <= 0) {
+            if (!sz or (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR)) {
+                FailConnection(con);
+            }
+            return;
+        }
+        con->done_sz += sz;
+        if (con->done_sz < FRAME_HEADER_SIZE) {
+            return;
+        }
+        FrameHeader hdr;
+        if (decodeAnyFrameHeader(con->hdr, &hdr)) {
+            FailConnection(con);
+            return;
+        } else if (hdr.type != FRAME_INTEGRATION_RESPONSE and
+            (hdr.type != FRAME_INTEGRATION_PROGRESS or !con->stream)
+        ) {
+            NetDebugPrint("Unexpected frame type %d from socket %d\n", hdr.type, s);
+            FailConnection(con);
+            return;
+        } else if (hdr.count != con->count) {
+            NetDebugPrint("Expected %zu responses from socket %d, got %zu\n", con->count, s, hdr.count);
+            FailConnection(con);
+            return;
+        }
+        con->buf_sz = hdr.length;
+        con->buf = malloc(con->buf_sz + 1);
+        if (!con->buf) {
+            NetDebugPrint("Allocation error\n");
+            FailConnection(con);
+            return;
+        }
+        con->frame_type = hdr.type;
+        con->done_sz = 0;
+        con->state = CONNECTION_RECIEVING_RECORDS;
+        // Go on to pick up records that arrived with the header
+    }
+    /* fallthrough */
+    case CONNECTION_RECIEVING_RECORDS:
+        if (con->done_sz < con->buf_sz) {
+            sz = recv(s, con->buf + con->done_sz, con->buf_sz - con->done_sz, 0);
+            if (sz <= 0) {
+                if (!sz or (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR)) {
+                    FailConnection(con);
+                }
+                return;
+            }
+            con->done_sz += sz;
+            NetTraceInstant("recv", sz);
+        }
+        if (con->done_sz < con->buf_sz) {
+            return;
+        }
+        decodeIntegrationResponses(con->buf, con->count, con->iresps);
+        free(con->buf);
+        con->buf = NULL;
+        if (con->frame_type == FRAME_INTEGRATION_PROGRESS) {
+            NetDebugPrint("Received progress of %zu requests from socket %d\n", con->count, s);
+            // A worker that reports progress is still alive
+            clock_gettime(CLOCK_MONOTONIC, &con->deadline);
+            con->deadline = TimespecAdd(con->deadline, CLIENT_PEER_RECIEVE_TIMEOUT_S);
+            con->progressed = true;
+            con->done_sz = 0;
+            con->state = CONNECTION_RECIEVING_HEADER;
+        } else {
+            NetDebugPrint("Received %zu responses from socket %d\n", con->count, s);
+            con->state = CONNECTION_DONE;
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+// Neumaier summation, c accumulates the low order bits lost from s
+static void CompensatedAdd(double* s, double* c, double v) {
+    double t = *s + v;
+    if (fabs(*s) >= fabs(v)) {
+        *c += (*s - t) + v;
+    } else {
+        *c += (v - t) + *s;
+    }
+    *s = t;
+}
+
+// Add up the responses to the pieces of every request
+static void SumPieces(
+    const WorkerConnection* connections, size_t con_cnt,
+    size_t count, double* compensations, IntegrationResponse* iresps_out
+) {
+    for (size_t j = 0; j < count; j++) {
+        iresps_out[j] = (IntegrationResponse) {};
+        compensations[j] = 0.0;
+    }
+    for (size_t i = 0; i < con_cnt; i++) {
+        const WorkerConnection* con = &connections[i];
+        for (size_t k = 0; k < con->count; k++) {
+            const IntegrationResponse* piece = &con->iresps[k];
+            size_t j = con->origins[k];
+            IntegrationResponse* iresp = &iresps_out[j];
+            CompensatedAdd(&iresp->ival, &compensations[j], piece->ival);
+            iresp->error += piece->error;
+            // Neighbouring pieces share their boundary point
+            iresp->evaluations += piece->evaluations - (iresp->evaluations and piece->evaluations ? 1: 0);
+            if (piece->compute_time > iresp->compute_time) {
+                iresp->compute_time = piece->compute_time;
+            }
+        }
+    }
+    for (size_t j = 0; j < count; j++) {
+        iresps_out[j].ival += compensations[j];
+    }
+}
+
+// Where RunConnections reports the progress of streaming connections
+typedef struct {
+    ClientProgressCallback  callback;
+    void*                   data;
+    size_t                  count;
+    double*                 compensations;
+    IntegrationResponse*    iresps;
+} ProgressInfo;
+
+// Drive all connections that are waiting for the network
+// until they are done, fail or miss their deadlines.
+// Returns 1 if the progress callback stopped it.
+static int RunConnections(
+    WorkerConnection* connections, size_t con_cnt, const ProgressInfo* progress
+) {
+    struct pollfd* fds = calloc(con_cnt, sizeof(*fds));
+    if (!fds) {
+        NetDebugPrint("Allocation error\n");
         return -1;
     }
-    *iresp_out = irespp.response;
 
+    while (true) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int timeout_ms = -1;
+        size_t waiting = 0;
+        for (size_t i = 0; i < con_cnt; i++) {
+            WorkerConnection* con = &connections[i];
+            fds[i].fd = -1;
+            if (!IsWaiting(con->state)) {
+                continue;
+            }
+            double left = TimespecDiff(&con->deadline, &now);
+            if (left <= 0) {
+                NetDebugPrint("Socket %d missed its deadline\n", con->socket);
+                FailConnection(con);
+                continue;
+            }
+            int left_ms = left * 1e3 + 1;
+            if (timeout_ms < 0 or left_ms < timeout_ms) {
+                timeout_ms = left_ms;
+            }
+            bool recieving =
+                con->state == CONNECTION_RECIEVING_HEADER or
+                con->state == CONNECTION_RECIEVING_RECORDS;
+            fds[i].fd = con->socket;
+            fds[i].events = recieving ? POLLIN: POLLOUT;
+            waiting++;
+        }
+        if (!waiting) {
+            break;
+        }
+
+        NetTraceBegin("poll", waiting);
+        int ready = poll(fds, con_cnt, timeout_ms);
+        NetTraceEnd("poll", ready);
+        if (ready < 0 and errno != EINTR) {
+            NetDebugPrint("Poll failed\n");
+            free(fds);
+            return -1;
+        }
+        bool progressed = false;
+        for (size_t i = 0; i < con_cnt; i++) {
+            if (fds[i].fd != -1 and fds[i].revents) {
+                StepConnection(&connections[i]);
+                progressed = progressed or connections[i].progressed;
+                connections[i].progressed = false;
+            }
+        }
+        if (progress and progressed) {
+            NetTraceInstant("progress", progress->count);
+            SumPieces(connections, con_cnt, progress->count, progress->compensations, progress->iresps);
+            if (progress->callback(progress->iresps, progress->count, progress->data)) {
+                NetDebugPrint("Stop waiting for responses\n");
+                free(fds);
+                return 1;
+            }
+        }
+    }
+
+    free(fds);
     return 0;
 }
 
-typedef struct {
-    Socket              s;
-    IntegrationRequest  ireq;
-    IntegrationResponse iresp;
-    int                 r;
-} ThreadData;
-
-void* SendAndRecieveProxy(void* p) {
-    ThreadData* thread_data = p;
-    thread_data->r = SendAndRecieve(thread_data->s, &thread_data->ireq, &thread_data->iresp);
-    return NULL;
+// Throughput a worker can give us, assuming it shares it equally
+// between the requests it is already working on and ours
+static double WorkerCapacity(const WorkerProperties* props) {
+    return props->throughput / (1 + props->queue_depth + props->active_jobs);
 }
 
-static void GetResponsesImpl(
-    size_t con_cnt,
-    pthread_t* thread_ids,
-    ThreadData* thread_datas
+static void SchedulePiece(WorkerConnection* con, size_t origin, IntegrationRequest ireq) {
+    con->ireqs[con->count] = ireq;
+    con->origins[con->count] = origin;
+    con->count++;
+    con->load += ireq.n;
+}
+
+// Split a request between all workers proportionally to their throughput
+static void ScheduleSplit(
+    WorkerConnection* connections, size_t con_cnt,
+    double total_throughput, size_t origin, const IntegrationRequest* ireq
 ) {
-    for (size_t i = 0; i < con_cnt; i++) {
-        int r = pthread_create(&thread_ids[i], NULL, SendAndRecieveProxy, &thread_datas[i]);
-        if (r) {
-            thread_datas[i].r = r;
+    size_t n = ireq->n;
+    size_t used_n = 0;
+    double step = (ireq->r - ireq->l) / n;
+    double l = ireq->l;
+    for (size_t i = 0; i < con_cnt - 1; i++) {
+        size_t this_n = WorkerCapacity(&connections[i].props) / total_throughput * n;
+        if (!this_n) {
+            continue;
         }
+        used_n += this_n;
+        double r = l + this_n * step;
+        SchedulePiece(&connections[i], origin, (IntegrationRequest) {
+            .l = l,
+            .r = r,
+            .n = this_n,
+            .timeout = ireq->timeout,
+        });
+        l = r;
+    }
+    // Schedule last piece
+    {
+        size_t i = con_cnt - 1;
+        size_t this_n = n - used_n;
+        double r = ireq->r;
+        SchedulePiece(&connections[i], origin, (IntegrationRequest) {
+            .l = l,
+            .r = r,
+            .n = this_n,
+            .timeout = ireq->timeout,
+        });
     }
+}
+
+// Send a small request as a whole to the worker that will finish it first
+static void ScheduleWhole(
+    WorkerConnection* connections, size_t con_cnt,
+    size_t origin, const IntegrationRequest* ireq
+) {
+    size_t best = 0;
+    double best_t = 0.0;
     for (size_t i = 0; i < con_cnt; i++) {
-        pthread_t t = thread_ids[i];
-        if (t) {
-            pthread_join(t, NULL);
+        double t = (connections[i].load + ireq->n) / WorkerCapacity(&connections[i].props);
+        if (i == 0 or t < best_t) {
+            best = i;
+            best_t = t;
         }
     }
+    SchedulePiece(&connections[best], origin, *ireq);
 }
 
 static int GetResponses(WorkerConnection* connections, size_t con_cnt,
-    const IntegrationRequest* ireq, IntegrationResponse* iresp_out
+    const IntegrationRequest* ireqs, size_t count, IntegrationResponse* iresps_out,
+    ClientProgressCallback callback, void* data
 ) {
-    pthread_t* thread_ids = calloc(con_cnt, sizeof(*thread_ids));
-    ThreadData* thread_datas = calloc(con_cnt, sizeof(*thread_datas));
-    
+    // Each worker gets at most one piece of every request
+    IntegrationRequest* pieces = calloc(con_cnt * count, sizeof(*pieces));
+    IntegrationResponse* piece_resps = calloc(con_cnt * count, sizeof(*piece_resps));
+    size_t* origins = calloc(con_cnt * count, sizeof(*origins));
+    double* compensations = calloc(count, sizeof(*compensations));
+
     int ret = 0;
-    if (thread_ids and thread_datas) {
+    if (pieces and piece_resps and origins and compensations) {
         double total_throughput = 0;
         for (size_t i = 0; i < con_cnt; i++) {
-            total_throughput += connections[i].props.throughput;
-        }
-
-        size_t n = ireq->n;
-        size_t used_n = 0;
-        float step = (ireq->r - ireq->l) / n;
-        float l = ireq->l;
-        for (size_t i = 0; i < con_cnt - 1; i++) {
-            size_t this_n = connections[i].props.throughput / total_throughput * n;
-            used_n += this_n;
-            float r = l + this_n * step;
-            thread_datas[i].s    = connections[i].socket;
-            thread_datas[i].ireq = (IntegrationRequest) {
-                .l = l,
-                .r = r,
-                .n = this_n,
-            };
-            l = r;
-        }
-        // Schedule last piece
-        {
-            size_t i = con_cnt - 1;
-            size_t this_n = n - used_n;
-            float r = ireq->r;
-            thread_datas[i].s    = connections[i].socket;
-            thread_datas[i].ireq = (IntegrationRequest) {
-                .l = l,
-                .r = r,
-                .n = this_n,
-            };
+            total_throughput += WorkerCapacity(&connections[i].props);
+            connections[i].ireqs   = &pieces[i * count];
+            connections[i].iresps  = &piece_resps[i * count];
+            connections[i].origins = &origins[i * count];
+        }
+
+        NetTraceBegin("schedule", count);
+        for (size_t j = 0; j < count; j++) {
+            if (count == 1 or ireqs[j].n >= CLIENT_SPLIT_MIN_N) {
+                ScheduleSplit(connections, con_cnt, total_throughput, j, &ireqs[j]);
+            } else {
+                ScheduleWhole(connections, con_cnt, j, &ireqs[j]);
+            }
         }
+        NetTraceEnd("schedule", count);
+#if NETDEBUG
         for (size_t i = 0; i < con_cnt; i++) {
-            const IntegrationRequest* ir = &thread_datas[i].ireq;
-            NetDebugPrint("Schedule request [%f; %f]/%zu to socket %d\n", ir->l, ir->r, ir->n, connections[i].socket);
+            for (size_t k = 0; k < connections[i].count; k++) {
+                const IntegrationRequest* ir = &connections[i].ireqs[k];
+                NetDebugPrint("Schedule request [%f; %f]/%zu to socket %d\n", ir->l, ir->r, ir->n, connections[i].socket);
+            }
         }
+#endif
 
-        GetResponsesImpl(con_cnt, thread_ids, thread_datas);
+        for (size_t i = 0; i < con_cnt; i++) {
+            connections[i].stream = callback != NULL;
+            StartSending(&connections[i]);
+        }
+        ProgressInfo progress = {
+            .callback = callback,
+            .data = data,
+            .count = count,
+            .compensations = compensations,
+            .iresps = iresps_out,
+        };
+        ret = RunConnections(connections, con_cnt, callback ? &progress: NULL);
         for (size_t i = 0; i < con_cnt and !ret; i++) {
-            ret = thread_datas[i].r;
+            if (connections[i].state != CONNECTION_DONE) {
+                ret = -1;
+            }
         }
 
         if (!ret) {
-            iresp_out->ival = 0.0f;
-            for (size_t i = 0; i < con_cnt; i++) {
-                iresp_out->ival += thread_datas[i].iresp.ival;
+            SumPieces(connections, con_cnt, count, compensations, iresps_out);
+            for (size_t j = 0; j < count; j++) {
+                if (isnan(iresps_out[j].ival)) {
+                    NetDebugPrint("Request %zu timed out\n", j);
+                    ret = -1;
+                }
             }
         }
     } else {
@@ -260,15 +769,35 @@ static int GetResponses(WorkerConnection* connections, size_t con_cnt,
         ret = -1;
     }
 
-    free(thread_ids);
-    free(thread_datas);
+    free(pieces);
+    free(piece_resps);
+    free(origins);
+    free(compensations);
 
     return ret;
 }
 
 int ClientSend(const IntegrationRequest* ireq, IntegrationResponse* iresp_out) {
+    return ClientSendBatch(ireq, 1, iresp_out);
+}
+
+int ClientSendBatch(
+    const IntegrationRequest* ireqs, size_t count, IntegrationResponse* iresps_out
+) {
+    return ClientSendStream(ireqs, count, iresps_out, NULL, NULL);
+}
+
+static int ClientSendStreamImpl(
+    const IntegrationRequest* ireqs, size_t count, IntegrationResponse* iresps_out,
+    ClientProgressCallback progress, void* data
+) {
+    if (count > MAX_FRAME_RECORDS) {
+        NetDebugPrint("Batch of %zu requests is too large\n", count);
+        return -1;
+    }
+
     WorkersInfo pinfo;
-    if (GetWorkers(DISCOVER_PORT_V, &pinfo)) {
+    if (GetWorkers(&pinfo)) {
         return -1;
     } else if (!pinfo.worker_count) {
         free(pinfo.workers);
@@ -276,16 +805,16 @@ int ClientSend(const IntegrationRequest* ireq, IntegrationResponse* iresp_out) {
         return -1;
     }
 
-    for (size_t i = 0; i < pinfo.worker_count; i++) {
-        pinfo.workers[i].addr.sin_port = htons(CALCULATE_PORT_V);
-    }
-
+#if NETDEBUG
     for (size_t i = 0; i < pinfo.worker_count; i++) {
         char buf[16];
         inet_ntop(AF_INET, &pinfo.workers[i].addr.sin_addr, buf, sizeof(buf));
-        NetDebugPrint("Found worker %zu at %s with %u threads and throughput %.0f/s\n",
-            i, buf, pinfo.workers[i].props.thread_count, pinfo.workers[i].props.throughput);
+        const WorkerProperties* props = &pinfo.workers[i].props;
+        NetDebugPrint("Found worker %zu at %s:%hu with %u threads, throughput %.0f/s, %u queued and %u active jobs\n",
+            i, buf, ntohs(pinfo.workers[i].addr.sin_port),
+            props->thread_count, props->throughput, props->queue_depth, props->active_jobs);
     }
+#endif
 
     WorkerConnection* connections = calloc(pinfo.worker_count, sizeof(*connections));
     if (!connections) {
@@ -293,42 +822,57 @@ int ClientSend(const IntegrationRequest* ireq, IntegrationResponse* iresp_out) {
         NetDebugPrint("Allocation error\n");
         return -1;
     }
+    // Connect to all workers at once, only the ones that accept get work
+    for (size_t i = 0; i < pinfo.worker_count; i++) {
+        connections[i].addr = pinfo.workers[i].addr;
+        connections[i].props = pinfo.workers[i].props;
+        StartConnection(&connections[i]);
+    }
+    free(pinfo.workers);
+    int r = RunConnections(connections, pinfo.worker_count, NULL);
+
     size_t con_cnt = 0;
     for (size_t i = 0; i < pinfo.worker_count; i++) {
-        Socket s = socket(PF_INET, SOCK_STREAM, 0);
-        if (connect(s, &pinfo.workers[i].addr, sizeof(pinfo.workers[i].addr))) {
-            NetDebugPrint("Failed to connect to socket %d\n", s);
-            close(s);
-            continue;
+        if (connections[i].state == CONNECTION_IDLE) {
+            connections[con_cnt++] = connections[i];
+        } else if (connections[i].socket != -1) {
+            close(connections[i].socket);
         }
-        struct timeval timeout = {
-            .tv_sec = CLIENT_PEER_RECIEVE_TIMEOUT_S,
-            .tv_usec = (CLIENT_PEER_RECIEVE_TIMEOUT_S - timeout.tv_sec) * 1e6,
-        };
-        NetDebugPrint("Set %lds %ldus timeout for socket %d\n", timeout.tv_sec, timeout.tv_usec, s);
-        if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
-            NetDebugPrint("Failed to set timeout\n");
-            close(s);
-            continue;
-        }
-        connections[con_cnt++] = (WorkerConnection) {
-            .socket = s,
-            .props  = pinfo.workers[i].props,
-        };
-        NetDebugPrint("Connected to socket %d for worker %zu\n", s, i);
     }
-    free(pinfo.workers);
 
-    int r = 0;
-    if (con_cnt) {
-        r = GetResponses(connections, con_cnt, ireq, iresp_out);
-    } else {
+    if (!r and con_cnt) {
+        r = GetResponses(connections, con_cnt, ireqs, count, iresps_out, progress, data);
+    } else if (!r) {
         NetDebugPrint("Failed establish any worker connections\n");
         r = -1;
     }
     for (size_t i = 0; i < con_cnt; i++) {
+        free(connections[i].buf);
         close(connections[i].socket);
     }
     free(connections);
     return r;
 }
+
+int ClientSendStream(
+    const IntegrationRequest* ireqs, size_t count, IntegrationResponse* iresps_out,
+    ClientProgressCallback progress, void* data
+) {
+    NetTraceBegin("client_send", count);
+    int r = ClientSendStreamImpl(ireqs, count, iresps_out, progress, data);
+    NetTraceEnd("client_send", r);
+    return r;
+}
+
+double ClientGetThroughput(void) {
+    WorkersInfo pinfo;
+    if (GetWorkers(&pinfo)) {
+        return 0.0;
+    }
+    double throughput = 0.0;
+    for (size_t i = 0; i < pinfo.worker_count; i++) {
+        throughput += WorkerCapacity(&pinfo.workers[i].props);
+    }
+    free(pinfo.workers);
+    return throughput;
+}
@@ -4,11 +4,46 @@ extern "C" {
 #endif
 #include "NetworkCommon.h"
 
+// How long to wait for the first worker if none are known yet
 static const double CLIENT_PEER_DISCOVERY_TIMEOUT_S = 0.1;
+// How long to keep collecting workers after the first one answers
+static const double CLIENT_PEER_DISCOVERY_GRACE_S   = 0.01;
+// Workers are rediscovered in the background this often
+static const double CLIENT_DISCOVERY_PERIOD_S       = 1;
+// Workers that have not answered for this long are forgotten
+static const double CLIENT_WORKER_EXPIRY_S          = 3.5;
+static const double CLIENT_PEER_CONNECT_TIMEOUT_S   = 1;
+// Time a worker may take to respond, or to send the next progress frame
 static const double CLIENT_PEER_RECIEVE_TIMEOUT_S   = 60;
+// Smaller requests in a batch are not split between workers
+static const size_t CLIENT_SPLIT_MIN_N = 1 << 20;
 
 int ClientSend(const IntegrationRequest* ireq, IntegrationResponse* iresp);
 
+// Send up to MAX_FRAME_RECORDS requests to the workers at once.
+// Fails if a worker gave up on a request because of its timeout,
+// the other responses are still filled in.
+int ClientSendBatch(
+    const IntegrationRequest* ireqs, size_t count, IntegrationResponse* iresps
+);
+
+// Called with the sums of the parts of every request that the workers
+// have finished so far, return nonzero to stop waiting for the rest
+typedef int (*ClientProgressCallback)(
+    const IntegrationResponse* partial, size_t count, void* data
+);
+
+// Like ClientSendBatch, but the workers report progress while they compute.
+// Returns 1 if progress stopped it, iresps then hold the last partial results.
+int ClientSendStream(
+    const IntegrationRequest* ireqs, size_t count, IntegrationResponse* iresps,
+    ClientProgressCallback progress, void* data
+);
+
+// Evaluations per second all known workers can give to a new request,
+// 0 if no workers could be found
+double ClientGetThroughput(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,37 +1,440 @@
+#define _GNU_SOURCE
 #include "NetworkCommon.h"
 
 #include <iso646.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 
-int sendAll(Socket sock, const void* buf, size_t* buf_sz_inout) {
-    size_t buf_sz = *buf_sz_inout;
+// Skip the first sz bytes of an iovec array,
+// return the number of iovecs that have been consumed entirely
+static size_t advanceIovecs(struct iovec* iov, size_t iovcnt, size_t sz) {
+    size_t i = 0;
+    for (; i < iovcnt and sz >= iov[i].iov_len; i++) {
+        sz -= iov[i].iov_len;
+        iov[i].iov_len = 0;
+    }
+    if (i < iovcnt) {
+        iov[i].iov_base = (char*)iov[i].iov_base + sz;
+        iov[i].iov_len -= sz;
+    }
+    return i;
+}
+
+int sendAllv(Socket sock, struct iovec* iov, size_t iovcnt, size_t* send_sz_out) {
     size_t send_sz = 0;
-    size_t sz = 0;
-    while (send_sz < buf_sz) {
-        sz = send(sock, (const char*)buf + send_sz, buf_sz - send_sz, 0);
+    ssize_t sz = 0;
+    size_t done = advanceIovecs(iov, iovcnt, 0);
+    while (done < iovcnt) {
+        struct msghdr msg = {
+            .msg_iov = iov + done,
+            .msg_iovlen = iovcnt - done,
+        };
+        sz = sendmsg(sock, &msg, MSG_NOSIGNAL);
         if (sz > 0) {
             send_sz += sz;
+            done += advanceIovecs(iov + done, iovcnt - done, sz);
         } else {
             break;
         }
     }
-    *buf_sz_inout = send_sz;
+    *send_sz_out = send_sz;
     return sz;
 }
 
-int recvAll(Socket sock, void* buf, size_t* buf_sz_inout) {
-    size_t buf_sz = *buf_sz_inout;
+int recvAllv(Socket sock, struct iovec* iov, size_t iovcnt, size_t* rcv_sz_out) {
     size_t rcv_sz = 0;
     ssize_t sz = 0;
-    while (rcv_sz < buf_sz) {
-        sz = recv(sock, (char*)buf + rcv_sz, buf_sz - rcv_sz, 0);
+    size_t done = advanceIovecs(iov, iovcnt, 0);
+    while (done < iovcnt) {
+        struct msghdr msg = {
+            .msg_iov = iov + done,
+            .msg_iovlen = iovcnt - done,
+        };
+        sz = recvmsg(sock, &msg, 0);
         if (sz > 0) {
             rcv_sz += sz;
+            done += advanceIovecs(iov + done, iovcnt - done, sz);
         } else {
             break;
         }
     }
-    *buf_sz_inout = rcv_sz;
+    *rcv_sz_out = rcv_sz;
     return sz;
 }
+
+int sendAll(Socket sock, const void* buf, size_t* buf_sz_inout) {
+    struct iovec iov = {
+        .iov_base = (void*)buf,
+        .iov_len = *buf_sz_inout,
+    };
+    return sendAllv(sock, &iov, 1, buf_sz_inout);
+}
+
+int recvAll(Socket sock, void* buf, size_t* buf_sz_inout) {
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = *buf_sz_inout,
+    };
+    return recvAllv(sock, &iov, 1, buf_sz_inout);
+}
+
+int sendAllm(Socket sock, struct mmsghdr* msgs, size_t msgcnt, size_t* send_cnt_out) {
+    size_t send_cnt = 0;
+    int r = 0;
+    while (send_cnt < msgcnt) {
+        r = sendmmsg(sock, msgs + send_cnt, msgcnt - send_cnt, MSG_NOSIGNAL);
+        if (r <= 0) {
+            break;
+        }
+        send_cnt += r;
+        // On stream sockets the last message may have been sent only in part
+        struct mmsghdr* last = &msgs[send_cnt - 1];
+        struct msghdr* hdr = &last->msg_hdr;
+        size_t done = advanceIovecs(hdr->msg_iov, hdr->msg_iovlen, last->msg_len);
+        if (done < hdr->msg_iovlen) {
+            hdr->msg_iov += done;
+            hdr->msg_iovlen -= done;
+            send_cnt--;
+        }
+    }
+    *send_cnt_out = send_cnt;
+    return r;
+}
+
+int recvAllm(Socket sock, struct mmsghdr* msgs, size_t msgcnt, size_t* rcv_cnt_out) {
+    size_t rcv_cnt = 0;
+    int r = 0;
+    while (rcv_cnt < msgcnt) {
+        r = recvmmsg(sock, msgs + rcv_cnt, msgcnt - rcv_cnt, MSG_WAITFORONE, NULL);
+        if (r > 0) {
+            rcv_cnt += r;
+        } else {
+            break;
+        }
+    }
+    *rcv_cnt_out = rcv_cnt;
+    return r;
+}
+
+static void putU16(unsigned char* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void putU32(unsigned char* p, uint32_t v) {
+    putU16(p, v >> 16);
+    putU16(p + 2, v);
+}
+
+static void putU64(unsigned char* p, uint64_t v) {
+    putU32(p, v >> 32);
+    putU32(p + 4, v);
+}
+
+static void putF64(unsigned char* p, double v) {
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    putU64(p, u);
+}
+
+static uint16_t getU16(const unsigned char* p) {
+    return (uint16_t)p[0] << 8 | p[1];
+}
+
+static uint32_t getU32(const unsigned char* p) {
+    return (uint32_t)getU16(p) << 16 | getU16(p + 2);
+}
+
+static uint64_t getU64(const unsigned char* p) {
+    return (uint64_t)getU32(p) << 32 | getU32(p + 4);
+}
+
+static double getF64(const unsigned char* p) {
+    uint64_t u = getU64(p);
+    double v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+size_t frameRecordSize(FrameType type) {
+    switch (type) {
+        case FRAME_DISCOVERY_REQUEST:
+            return 0;
+        case FRAME_DISCOVERY_RESPONSE:
+            return DISCOVERY_RESPONSE_SIZE;
+        case FRAME_INTEGRATION_REQUEST:
+        case FRAME_INTEGRATION_STREAM_REQUEST:
+            return INTEGRATION_REQUEST_SIZE;
+        case FRAME_INTEGRATION_RESPONSE:
+        case FRAME_INTEGRATION_PROGRESS:
+            return INTEGRATION_RESPONSE_SIZE;
+    }
+    return 0;
+}
+
+void encodeFrameHeader(FrameType type, size_t count, void* buf) {
+    unsigned char* p = buf;
+    putU32(p, PROTOCOL_MAGIC);
+    putU16(p + 4, PROTOCOL_VERSION);
+    putU16(p + 6, type);
+    putU32(p + 8, count);
+    putU32(p + 12, count * frameRecordSize(type));
+}
+
+int decodeAnyFrameHeader(const void* buf, FrameHeader* hdr) {
+    const unsigned char* p = buf;
+    if (getU32(p) != PROTOCOL_MAGIC) {
+        NetDebugPrint("Wrong magic number\n");
+        return -1;
+    } else if (getU16(p + 4) != PROTOCOL_VERSION) {
+        NetDebugPrint("Unsupported protocol version %u\n", getU16(p + 4));
+        return -1;
+    }
+    unsigned type = getU16(p + 6);
+    if (type < FRAME_DISCOVERY_REQUEST or type > FRAME_INTEGRATION_PROGRESS) {
+        NetDebugPrint("Unknown frame type %u\n", type);
+        return -1;
+    }
+    hdr->type = type;
+    hdr->count = getU32(p + 8);
+    hdr->length = getU32(p + 12);
+    if (hdr->count > MAX_FRAME_RECORDS) {
+        NetDebugPrint("Too many records in frame: %zu\n", hdr->count);
+        return -1;
+    } else if (hdr->length != hdr->count * frameRecordSize(hdr->type)) {
+        NetDebugPrint("Wrong frame length %zu for %zu records\n", hdr->length, hdr->count);
+        return -1;
+    }
+    return 0;
+}
+
+int decodeFrameHeader(const void* buf, FrameType type, FrameHeader* hdr) {
+    if (decodeAnyFrameHeader(buf, hdr)) {
+        return -1;
+    } else if (hdr->type != type) {
+        NetDebugPrint("Expected frame type %d, got %d\n", type, hdr->type);
+        return -1;
+    }
+    return 0;
+}
+
+void encodeDiscoveryResponse(const DiscoveryResponse* dresp, void* buf) {
+    unsigned char* p = buf;
+    putU32(p, dresp->props.thread_count);
+    putF64(p + 4, dresp->props.throughput);
+    putU32(p + 12, dresp->props.queue_depth);
+    putU32(p + 16, dresp->props.active_jobs);
+    putU32(p + 20, dresp->instance);
+    putU16(p + 24, dresp->port);
+}
+
+void decodeDiscoveryResponse(const void* buf, DiscoveryResponse* dresp) {
+    const unsigned char* p = buf;
+    dresp->props.thread_count = getU32(p);
+    dresp->props.throughput = getF64(p + 4);
+    dresp->props.queue_depth = getU32(p + 12);
+    dresp->props.active_jobs = getU32(p + 16);
+    dresp->instance = getU32(p + 20);
+    dresp->port = getU16(p + 24);
+}
+
+void encodeIntegrationRequests(const IntegrationRequest* ireqs, size_t count, void* buf) {
+    unsigned char* p = buf;
+    for (size_t i = 0; i < count; i++, p += INTEGRATION_REQUEST_SIZE) {
+        putF64(p, ireqs[i].l);
+        putF64(p + 8, ireqs[i].r);
+        putU64(p + 16, ireqs[i].n);
+        putF64(p + 24, ireqs[i].timeout);
+    }
+}
+
+void decodeIntegrationRequests(const void* buf, size_t count, IntegrationRequest* ireqs) {
+    const unsigned char* p = buf;
+    for (size_t i = 0; i < count; i++, p += INTEGRATION_REQUEST_SIZE) {
+        ireqs[i].l = getF64(p);
+        ireqs[i].r = getF64(p + 8);
+        ireqs[i].n = getU64(p + 16);
+        ireqs[i].timeout = getF64(p + 24);
+    }
+}
+
+void encodeIntegrationResponses(const IntegrationResponse* iresps, size_t count, void* buf) {
+    unsigned char* p = buf;
+    for (size_t i = 0; i < count; i++, p += INTEGRATION_RESPONSE_SIZE) {
+        putF64(p, iresps[i].ival);
+        putF64(p + 8, iresps[i].error);
+        putU64(p + 16, iresps[i].evaluations);
+        putF64(p + 24, iresps[i].compute_time);
+    }
+}
+
+void decodeIntegrationResponses(const void* buf, size_t count, IntegrationResponse* iresps) {
+    const unsigned char* p = buf;
+    for (size_t i = 0; i < count; i++, p += INTEGRATION_RESPONSE_SIZE) {
+        iresps[i].ival = getF64(p);
+        iresps[i].error = getF64(p + 8);
+        iresps[i].evaluations = getU64(p + 16);
+        iresps[i].compute_time = getF64(p + 24);
+    }
+}
+
+// Header and records leave in a single sendmsg unless the socket buffer is full
+static int sendFrame(Socket sock, void* hdr, void* records, size_t records_sz) {
+    struct iovec iov[] = {
+        {
+            .iov_base = hdr,
+            .iov_len = FRAME_HEADER_SIZE,
+        },
+        {
+            .iov_base = records,
+            .iov_len = records_sz,
+        },
+    };
+    size_t frame_sz = FRAME_HEADER_SIZE + records_sz;
+    size_t send_sz;
+    NetDebugPrint("Send frame to socket %d\n", sock);
+    NetTraceBegin("send_frame", frame_sz);
+    sendAllv(sock, iov, sizeof(iov) / sizeof(*iov), &send_sz);
+    NetTraceEnd("send_frame", send_sz);
+    NetDebugPrint("Sent %zu/%zu bytes to socket %d\n", send_sz, frame_sz, sock);
+    return send_sz == frame_sz ? 0: -1;
+}
+
+// Receive a frame of one of the given types and return its records
+// in a buffer that must be freed by the caller
+static int recvFrame(
+    Socket sock, const FrameType* types, size_t type_cnt, FrameHeader* hdr, void** records_out
+) {
+    unsigned char hdr_buf[FRAME_HEADER_SIZE];
+    size_t rcv_sz = sizeof(hdr_buf);
+    NetDebugPrint("Receive frame header from socket %d\n", sock);
+    recvAll(sock, hdr_buf, &rcv_sz);
+    if (rcv_sz != sizeof(hdr_buf)) {
+        NetDebugPrint("Received %zu/%zu header bytes from socket %d\n", rcv_sz, sizeof(hdr_buf), sock);
+        return -1;
+    } else if (decodeAnyFrameHeader(hdr_buf, hdr)) {
+        return -1;
+    }
+    bool accepted = false;
+    for (size_t i = 0; i < type_cnt; i++) {
+        accepted = accepted or hdr->type == types[i];
+    }
+    if (!accepted) {
+        NetDebugPrint("Unexpected frame type %d from socket %d\n", hdr->type, sock);
+        return -1;
+    }
+
+    void* records = malloc(hdr->length + 1);
+    if (!records) {
+        NetDebugPrint("Allocation error\n");
+        return -1;
+    }
+    rcv_sz = hdr->length;
+    recvAll(sock, records, &rcv_sz);
+    NetDebugPrint("Received %zu/%zu record bytes from socket %d\n", rcv_sz, hdr->length, sock);
+    if (rcv_sz != hdr->length) {
+        free(records);
+        return -1;
+    }
+    *records_out = records;
+    return 0;
+}
+
+int sendIntegrationRequests(Socket sock, const IntegrationRequest* ireqs, size_t count) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    size_t records_sz = count * INTEGRATION_REQUEST_SIZE;
+    unsigned char* records = malloc(records_sz + 1);
+    if (!records) {
+        NetDebugPrint("Allocation error\n");
+        return -1;
+    }
+    encodeFrameHeader(FRAME_INTEGRATION_REQUEST, count, hdr);
+    encodeIntegrationRequests(ireqs, count, records);
+    int r = sendFrame(sock, hdr, records, records_sz);
+    free(records);
+    return r;
+}
+
+int recvIntegrationRequests(
+    Socket sock, IntegrationRequest** ireqs_out, size_t* count_out, FrameType* type_out
+) {
+    static const FrameType types[] = {
+        FRAME_INTEGRATION_REQUEST,
+        FRAME_INTEGRATION_STREAM_REQUEST,
+    };
+    FrameHeader hdr;
+    void* records;
+    NetTraceBegin("recv_requests", 0);
+    int r = recvFrame(sock, types, sizeof(types) / sizeof(*types), &hdr, &records);
+    NetTraceEnd("recv_requests", r ? 0: hdr.count);
+    if (r) {
+        return -1;
+    }
+    IntegrationRequest* ireqs = calloc(hdr.count + 1, sizeof(*ireqs));
+    if (!ireqs) {
+        NetDebugPrint("Allocation error\n");
+        free(records);
+        return -1;
+    }
+    decodeIntegrationRequests(records, hdr.count, ireqs);
+    free(records);
+    for (size_t i = 0; i < hdr.count; i++) {
+        // Workers index points with signed 64 bit integers
+        if (ireqs[i].n > INT64_MAX) {
+            NetDebugPrint("Request %zu has too many points: %zu\n", i, ireqs[i].n);
+            free(ireqs);
+            return -1;
+        }
+    }
+    *ireqs_out = ireqs;
+    *count_out = hdr.count;
+    *type_out = hdr.type;
+    return 0;
+}
+
+static int sendResponseFrame(
+    Socket sock, FrameType type, const IntegrationResponse* iresps, size_t count
+) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    size_t records_sz = count * INTEGRATION_RESPONSE_SIZE;
+    unsigned char* records = malloc(records_sz + 1);
+    if (!records) {
+        NetDebugPrint("Allocation error\n");
+        return -1;
+    }
+    encodeFrameHeader(type, count, hdr);
+    encodeIntegrationResponses(iresps, count, records);
+    int r = sendFrame(sock, hdr, records, records_sz);
+    free(records);
+    return r;
+}
+
+int sendIntegrationResponses(Socket sock, const IntegrationResponse* iresps, size_t count) {
+    return sendResponseFrame(sock, FRAME_INTEGRATION_RESPONSE, iresps, count);
+}
+
+int sendIntegrationProgress(Socket sock, const IntegrationResponse* iresps, size_t count) {
+    return sendResponseFrame(sock, FRAME_INTEGRATION_PROGRESS, iresps, count);
+}
+
+int recvIntegrationResponses(Socket sock, IntegrationResponse* iresps, size_t count) {
+    static const FrameType types[] = { FRAME_INTEGRATION_RESPONSE };
+    FrameHeader hdr;
+    void* records;
+    NetTraceBegin("recv_responses", 0);
+    int r = recvFrame(sock, types, sizeof(types) / sizeof(*types), &hdr, &records);
+    NetTraceEnd("recv_responses", r ? 0: hdr.count);
+    if (r) {
+        return -1;
+    }
+    if (hdr.count == count) {
+        decodeIntegrationResponses(records, count, iresps);
+    } else {
+        NetDebugPrint("Expected %zu responses from socket %d, got %zu\n", count, sock, hdr.count);
+        r = -1;
+    }
+    free(records);
+    return r;
+}
@@ -2,57 +2,114 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#include "NetworkTrace.h"
+
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #define DISCOVER_PORT       "5161"
 #define DISCOVER_PORT_V     5161
 #define CALCULATE_PORT      "5162"
 #define CALCULATE_PORT_V    5162
-
-typedef int magic_t;
-enum { MAGIC_V = 0x1DEAD1 };
+// Server instance i also listens on INSTANCE_PORT_V + i alone
+#define INSTANCE_PORT_V     5170
+// Server instance i reports its metrics on STATS_PORT_V + i on loopback
+#define STATS_PORT_V        5180
 
 typedef struct {
     unsigned thread_count;
+    // Recent evaluations per second
     double   throughput;
+    // Requests waiting for a compute thread
+    unsigned queue_depth;
+    // Requests being computed
+    unsigned active_jobs;
 } WorkerProperties;
 
-typedef struct {
-    int pad;
-} DiscoveryRequest;
-
-typedef struct {
-    magic_t magic;
-    DiscoveryRequest request;
-} DiscoveryRequestPacket;
-
 typedef struct {
     WorkerProperties props;
+    // Server instance on the host and the port that reaches only it
+    unsigned         instance;
+    unsigned short   port;
 } DiscoveryResponse;
 
 typedef struct {
-    magic_t magic;
-    DiscoveryResponse response;
-} DiscoveryResponsePacket;
-
-typedef struct {
-    float l, r;
+    double l, r;
     size_t n;
+    // Seconds the worker may spend on the request, 0 for no limit
+    double timeout;
 } IntegrationRequest;
 
 typedef struct {
-    magic_t magic;
-    IntegrationRequest request;
-} IntegrationRequestPacket;
-
-typedef struct {
-    float ival;
+    double ival;
+    // Estimated error of ival
+    double error;
+    size_t evaluations;
+    // Time the worker spent computing ival
+    double compute_time;
 } IntegrationResponse;
+// Workers answer requests they gave up on with a NaN ival and error
+
+// Every message is a frame: a header followed by count records.
+// All fields are fixed width and big-endian on the wire, floating point
+// numbers are sent as their IEEE 754 bit patterns.
+//
+// Header:               u32 magic, u16 version, u16 type, u32 count,
+//                       u32 length of the records in bytes
+// DiscoveryResponse:    u32 thread_count, f64 throughput, u32 queue_depth,
+//                       u32 active_jobs, u32 instance, u16 port
+// IntegrationRequest:   f64 l, f64 r, u64 n, f64 timeout
+// IntegrationResponse:  f64 ival, f64 error, u64 evaluations,
+//                       f64 compute_time
+//
+// A stream request has the records of a request. It is answered with any
+// number of progress frames, holding the sums of the parts of every request
+// that are done so far as responses, followed by the response frame.
+enum {
+    PROTOCOL_MAGIC      = 0x1DEAD1,
+    PROTOCOL_VERSION    = 6,
+};
+
+typedef enum {
+    FRAME_DISCOVERY_REQUEST     = 1,
+    FRAME_DISCOVERY_RESPONSE    = 2,
+    FRAME_INTEGRATION_REQUEST   = 3,
+    FRAME_INTEGRATION_RESPONSE  = 4,
+    FRAME_INTEGRATION_STREAM_REQUEST = 5,
+    FRAME_INTEGRATION_PROGRESS  = 6,
+} FrameType;
+
+enum {
+    FRAME_HEADER_SIZE           = 16,
+    DISCOVERY_RESPONSE_SIZE     = 26,
+    INTEGRATION_REQUEST_SIZE    = 32,
+    INTEGRATION_RESPONSE_SIZE   = 32,
+    // Upper bound on the number of records in one frame
+    MAX_FRAME_RECORDS           = 4096,
+};
 
 typedef struct {
-    magic_t magic;
-    IntegrationResponse response;
-} IntegrationResponsePacket;
+    FrameType   type;
+    size_t      count;
+    size_t      length;
+} FrameHeader;
+
+size_t frameRecordSize(FrameType type);
+
+void encodeFrameHeader(FrameType type, size_t count, void* buf);
+// Fails if the header is not a valid frame of the expected type
+int decodeFrameHeader(const void* buf, FrameType type, FrameHeader* hdr_out);
+// Fails if the header is not a valid frame of any type
+int decodeAnyFrameHeader(const void* buf, FrameHeader* hdr_out);
+
+void encodeDiscoveryResponse(const DiscoveryResponse* dresp, void* buf);
+void decodeDiscoveryResponse(const void* buf, DiscoveryResponse* dresp_out);
+void encodeIntegrationRequests(const IntegrationRequest* ireqs, size_t count, void* buf);
+void decodeIntegrationRequests(const void* buf, size_t count, IntegrationRequest* ireqs_out);
+void encodeIntegrationResponses(const IntegrationResponse* iresps, size_t count, void* buf);
+void decodeIntegrationResponses(const void* buf, size_t count, IntegrationResponse* iresps_out);
 
 typedef int         Socket;
 typedef const char* Port;
@@ -60,6 +117,29 @@ typedef const char* Port;
 int sendAll(Socket sock, const void* buf, size_t* buf_sz_inout);
 int recvAll(Socket sock,       void* buf, size_t* buf_sz_inout);
 
+// Vectored versions of sendAll and recvAll, iov is advanced past
+// the bytes that have been transferred
+int sendAllv(Socket sock, struct iovec* iov, size_t iovcnt, size_t* send_sz_out);
+int recvAllv(Socket sock, struct iovec* iov, size_t iovcnt, size_t* rcv_sz_out);
+
+// Send all messages with as few sendmmsg calls as possible.
+// A message that is sent only in part on a stream socket is resumed,
+// so the messages' iovecs are advanced like in sendAllv.
+int sendAllm(Socket sock, struct mmsghdr* msgs, size_t msgcnt, size_t* send_cnt_out);
+// Receive up to msgcnt messages, stops at the first error or timeout
+int recvAllm(Socket sock, struct mmsghdr* msgs, size_t msgcnt, size_t* rcv_cnt_out);
+
+int sendIntegrationRequests(Socket sock, const IntegrationRequest* ireqs, size_t count);
+// The returned requests must be freed by the caller, type_out tells
+// whether they came in a plain or in a stream request frame
+int recvIntegrationRequests(
+    Socket sock, IntegrationRequest** ireqs_out, size_t* count_out, FrameType* type_out
+);
+int sendIntegrationResponses(Socket sock, const IntegrationResponse* iresps, size_t count);
+int sendIntegrationProgress(Socket sock, const IntegrationResponse* iresps, size_t count);
+// Fails unless exactly count responses are received
+int recvIntegrationResponses(Socket sock, IntegrationResponse* iresps_out, size_t count);
+
 #ifndef NETDEBUG
 #define NETDEBUG 0
 #endif
@@ -68,7 +148,7 @@ int recvAll(Socket sock,       void* buf, size_t* buf_sz_inout);
 #include <stdio.h>
 #define NetDebugPrint(...) fprintf(stderr, __VA_ARGS__)
 #else
-#define NetDebugPrint(...) (void)(__VA_ARGS__)
+#define NetDebugPrint(...) do {} while (0)
 #endif
 
 #ifdef __cplusplus
@@ -1,11 +1,16 @@
 #define _GNU_SOURCE
 #include "NetworkServer.h"
 
+#include <iso646.h>
 #include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/file.h>
 #include <poll.h>
+#include <stdlib.h>
+#include <time.h>
 
 static int AcquireFlock(const char* path) {
     int f = open(path, O_CREAT, 0600);
@@ -16,15 +21,7 @@ static int AcquireFlock(const char* path) {
     return f;
 }
 
-int static ServerListenImpl(unsigned short listen_port, ListenInfo* linfo) {
-    static const char* lock_file_path = "/tmp/pw_lock_file";
-
-    int l = linfo->lock = AcquireFlock(lock_file_path);
-    if (l == -1) {
-        NetDebugPrint("Failed to acquire lock file %s\n", lock_file_path);
-        return -1;
-    }
-
+static Socket ListenOn(unsigned short listen_port, bool share_port) {
     struct sockaddr_in ai = {
         .sin_addr = {
             .s_addr = INADDR_ANY,
@@ -33,49 +30,111 @@ int static ServerListenImpl(unsigned short listen_port, ListenInfo* linfo) {
         .sin_port = htons(listen_port),
     };
 
-    Socket s = linfo->socket = socket(PF_INET, SOCK_STREAM, 0);
+    Socket s = socket(PF_INET, SOCK_STREAM, 0);
     if (s == -1) {
         return -1;
     }
     int reuse = 1;
     if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))) {
-        return -1;
+        goto fail;
+    }
+    // Connections to a shared port are balanced between all its listeners
+    if (share_port and setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))) {
+        goto fail;
     }
     if (bind(s, (const void*) &ai, sizeof(ai))) {
-        return -1;
+        goto fail;
     }
     enum { QUEUE_COUNT = 10 };
     if (listen(s, QUEUE_COUNT)) {
+        goto fail;
+    }
+
+    NetDebugPrint("Begin listening on socket %d for port %hu\n", s, listen_port);
+    return s;
+
+fail:
+    close(s);
+    return -1;
+}
+
+int static ServerListenImpl(unsigned short listen_port, unsigned instance, ListenInfo* linfo) {
+    char lock_file_path[64];
+    snprintf(lock_file_path, sizeof(lock_file_path), "/tmp/pw_lock_file_%u", instance);
+
+    int l = linfo->lock = AcquireFlock(lock_file_path);
+    if (l == -1) {
+        NetDebugPrint("Failed to acquire lock file %s\n", lock_file_path);
         return -1;
     }
 
-    NetDebugPrint("Begin listening on socket %d\n", s);
+    linfo->socket = ListenOn(listen_port, true);
+    if (linfo->socket == -1) {
+        return -1;
+    }
+    linfo->instance_port = INSTANCE_PORT_V + instance;
+    linfo->instance_socket = ListenOn(linfo->instance_port, false);
+    if (linfo->instance_socket == -1) {
+        return -1;
+    }
 
     return 0;
-
 }
 
-int ServerListen(unsigned short listen_port, ListenInfo* linfo) {
+int ServerListen(unsigned short listen_port, unsigned instance, ListenInfo* linfo) {
     *linfo = (ListenInfo) {
         .lock = -1,
         .socket = -1,
+        .instance_socket = -1,
     };
-    int r = ServerListenImpl(listen_port, linfo);
+    int r = ServerListenImpl(listen_port, instance, linfo);
     if (r) {
         close(linfo->lock);
         close(linfo->socket);
+        close(linfo->instance_socket);
     }
     return r;
 }
 
+static double SecondsSince(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
 static int ServerRecieveImpl(const ListenInfo* linfo, RequestInfo* rinfo) {
-    NetDebugPrint("Accept connection on socket %d\n", linfo->socket);
-    Socket s = rinfo->socket = accept(linfo->socket, NULL, NULL);
+    struct pollfd fds[] = {
+        {
+            .fd = linfo->socket,
+            .events = POLLIN,
+        },
+        {
+            .fd = linfo->instance_socket,
+            .events = POLLIN,
+        },
+    };
+    NetDebugPrint("Wait for connections on sockets %d and %d\n", linfo->socket, linfo->instance_socket);
+    NetTraceBegin("wait_connection", 0);
+    int ready = poll(fds, sizeof(fds) / sizeof(*fds), -1);
+    NetTraceEnd("wait_connection", ready);
+    if (ready < 0) {
+        NetDebugPrint("Failed to wait for connections\n");
+        return 1;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Socket l = fds[0].revents ? linfo->socket: linfo->instance_socket;
+    NetDebugPrint("Accept connection on socket %d\n", l);
+    NetTraceBegin("accept", l);
+    Socket s = rinfo->socket = accept(l, NULL, NULL);
+    NetTraceEnd("accept", s);
     if (s == -1) {
         NetDebugPrint("Failed to accept connection\n");
         return 1;
     }
     NetDebugPrint("Accepted connection %d\n", rinfo->socket);
+    rinfo->accept_time = SecondsSince(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     struct timeval timeout = {
         .tv_sec = SERVER_RECIEVE_TIMEOUT_S,
@@ -87,27 +146,31 @@ static int ServerRecieveImpl(const ListenInfo* linfo, RequestInfo* rinfo) {
         return 1;
     }
 
-    IntegrationRequestPacket ireqp;
-    size_t rcv_sz = sizeof(ireqp);
-    NetDebugPrint("Receive request\n");
-    recvAll(s, &ireqp, &rcv_sz);
-    NetDebugPrint("Received %zu/%zu bytes\n", rcv_sz, sizeof(ireqp));
-    if (rcv_sz != sizeof(ireqp)) {
-        return 1;
-    } else if (ireqp.magic != MAGIC_V) {
-        NetDebugPrint("Wrong magic number\n");
+    NetDebugPrint("Receive requests\n");
+    FrameType type;
+    if (recvIntegrationRequests(s, &rinfo->integration_requests, &rinfo->request_count, &type)) {
         return 1;
     }
-    rinfo->integration_request = ireqp.request;
+    rinfo->stream = type == FRAME_INTEGRATION_STREAM_REQUEST;
+    rinfo->recieve_time = SecondsSince(&start);
 
-    {   const IntegrationRequest* ir = &rinfo->integration_request;
-        NetDebugPrint("Received request [%f; %f]/%zu\n", ir->l, ir->r, ir->n);  }
+#if NETDEBUG
+    for (size_t i = 0; i < rinfo->request_count; i++) {
+        const IntegrationRequest* ir = &rinfo->integration_requests[i];
+        NetDebugPrint("Received request [%f; %f]/%zu\n", ir->l, ir->r, ir->n);
+    }
+#endif
 
     return 0;
 }
 
 int ServerRecieve(const ListenInfo* linfo, RequestInfo* rinfo) {
     rinfo->socket = -1;
+    rinfo->integration_requests = NULL;
+    rinfo->request_count = 0;
+    rinfo->stream = false;
+    rinfo->accept_time = 0.0;
+    rinfo->recieve_time = 0.0;
     int r = ServerRecieveImpl(linfo, rinfo);
     if (r) {
         close(rinfo->socket);
@@ -115,22 +178,48 @@ int ServerRecieve(const ListenInfo* linfo, RequestInfo* rinfo) {
     return r;
 }
 
+void ServerFreeRequest(RequestInfo* rinfo) {
+    free(rinfo->integration_requests);
+    rinfo->integration_requests = NULL;
+    rinfo->request_count = 0;
+}
+
 int ServerRespond(const ResponseInfo* rinfo) {
-    IntegrationResponsePacket irespp = {
-        .magic = MAGIC_V,
-        .response = rinfo->integration_response,
-    };
-    size_t send_sz = sizeof(irespp);
-    NetDebugPrint("Send response\n");
-    sendAll(rinfo->socket, &irespp, &send_sz);
-    NetDebugPrint("Sent %zu/%zu bytes\n", send_sz, sizeof(irespp));
+    NetDebugPrint("Send %zu responses\n", rinfo->response_count);
+    NetTraceBegin("respond", rinfo->response_count);
+    int r = sendIntegrationResponses(
+        rinfo->socket, rinfo->integration_responses, rinfo->response_count
+    );
     close(rinfo->socket);
-    if (send_sz != sizeof(irespp)) {
+    NetTraceEnd("respond", r);
+    if (r) {
         return 1;
     }
     return 0;
 }
 
+int ServerSendProgress(const ResponseInfo* rinfo) {
+    NetDebugPrint("Send progress of %zu requests\n", rinfo->response_count);
+    NetTraceInstant("progress", rinfo->response_count);
+    if (sendIntegrationProgress(
+        rinfo->socket, rinfo->integration_responses, rinfo->response_count
+    )) {
+        return 1;
+    }
+    return 0;
+}
+
+bool ServerClientGone(const RequestInfo* rinfo) {
+    struct pollfd fd = {
+        .fd = rinfo->socket,
+        .events = POLLRDHUP,
+    };
+    if (poll(&fd, 1, 0) < 0) {
+        return false;
+    }
+    return fd.revents & (POLLRDHUP | POLLHUP | POLLERR);
+}
+
 void ServerRespondError(const RequestInfo* rinfo) {
     close(rinfo->socket);
 }
@@ -172,31 +261,95 @@ int ServerStartDiscovery(unsigned short discover_port, DiscoveryInfo* dinfo) {
     return r;
 }
 
-int ServerProcessDiscoveryRequest(const DiscoveryInfo* dinfo) {
-    struct sockaddr_storage they;
-    socklen_t they_sz = sizeof(they);
+int ServerRecieveDiscoveryRequest(const DiscoveryInfo* dinfo, DiscoveryPeer* peer) {
+    peer->addr_sz = sizeof(peer->addr);
 
-    DiscoveryRequestPacket dreqp;
+    unsigned char dreq[FRAME_HEADER_SIZE];
+    FrameHeader hdr;
     NetDebugPrint("Wait for discovery request on socket %d\n", dinfo->socket);
-    ssize_t sz = recvfrom(dinfo->socket, &dreqp, sizeof(dreqp), 0, (void*) &they, &they_sz);
-    if (sz != sizeof(dreqp)) {
+    ssize_t sz = recvfrom(dinfo->socket, dreq, sizeof(dreq), 0, (void*) &peer->addr, &peer->addr_sz);
+    if (sz != sizeof(dreq)) {
         NetDebugPrint("Failed to recieve discovery request\n");
         return 1;
-    } else if (dreqp.magic != MAGIC_V) {
-        NetDebugPrint("Wrong magic number\n");
+    } else if (decodeFrameHeader(dreq, FRAME_DISCOVERY_REQUEST, &hdr)) {
         return 1;
     }
+    NetTraceInstant("discovery_request", 0);
 
-    DiscoveryResponsePacket drespp = {
-        .magic = MAGIC_V,
-        .response = dinfo->response,
-    };
+    return 0;
+}
+
+int ServerRespondDiscovery(
+    const DiscoveryInfo* dinfo, const DiscoveryPeer* peer, const DiscoveryResponse* dresp
+) {
+    unsigned char buf[FRAME_HEADER_SIZE + DISCOVERY_RESPONSE_SIZE];
+    encodeFrameHeader(FRAME_DISCOVERY_RESPONSE, 1, buf);
+    encodeDiscoveryResponse(dresp, buf + FRAME_HEADER_SIZE);
     NetDebugPrint("Send discovery response\n");
-    sz = sendto(dinfo->socket, &drespp, sizeof(drespp), 0, (const void*) &they, they_sz);
-    if (sz != sizeof(drespp)) {
+    ssize_t sz = sendto(dinfo->socket, buf, sizeof(buf), 0, (const void*) &peer->addr, peer->addr_sz);
+    if (sz != sizeof(buf)) {
         NetDebugPrint("Failed to send discovery response\n");
         return 1;
     }
 
     return 0;
 }
+
+static int ServerStartStatsImpl(unsigned short stats_port, StatsInfo* sinfo) {
+    struct sockaddr_in ai = {
+        .sin_addr = {
+            .s_addr = htonl(INADDR_LOOPBACK),
+        },
+        .sin_family = AF_INET,
+        .sin_port = htons(stats_port),
+    };
+
+    Socket s = sinfo->socket = socket(PF_INET, SOCK_STREAM, 0);
+    if (s == -1) {
+        return -1;
+    }
+    int reuse = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))) {
+        return -1;
+    }
+    if (bind(s, (const void*) &ai, sizeof(ai))) {
+        return -1;
+    }
+    enum { QUEUE_COUNT = 4 };
+    if (listen(s, QUEUE_COUNT)) {
+        return -1;
+    }
+
+    NetDebugPrint("Begin stats service on socket %d for port %hu\n", s, stats_port);
+    return 0;
+}
+
+int ServerStartStats(unsigned short stats_port, StatsInfo* sinfo) {
+    sinfo->socket = -1;
+    int r = ServerStartStatsImpl(stats_port, sinfo);
+    if (r) {
+        close(sinfo->socket);
+    }
+    return r;
+}
+
+int ServerAcceptStats(const StatsInfo* sinfo, Socket* socket_out) {
+    Socket s = accept(sinfo->socket, NULL, NULL);
+    if (s == -1) {
+        NetDebugPrint("Failed to accept stats connection\n");
+        return 1;
+    }
+    *socket_out = s;
+    return 0;
+}
+
+int ServerSendStats(Socket socket, const char* report, size_t report_sz) {
+    size_t sz = report_sz;
+    sendAll(socket, report, &sz);
+    close(socket);
+    if (sz != report_sz) {
+        NetDebugPrint("Sent %zu/%zu stats bytes\n", sz, report_sz);
+        return 1;
+    }
+    return 0;
+}
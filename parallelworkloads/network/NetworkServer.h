@@ -4,39 +4,83 @@ extern "C" {
 #endif
 #include "NetworkCommon.h"
 
+#include <stdbool.h>
+
 static double SERVER_RECIEVE_TIMEOUT_S = 1;
 
 typedef struct {
-    Socket  socket;
-    int     lock;
+    // Listens on the port shared by all instances on the host
+    Socket          socket;
+    // Listens on the port of this instance alone
+    Socket          instance_socket;
+    unsigned short  instance_port;
+    int             lock;
 } ListenInfo;
 
-int ServerListen(unsigned short listen_port, ListenInfo* linfo_out);
+int ServerListen(unsigned short listen_port, unsigned instance, ListenInfo* linfo_out);
 
 typedef struct {
-    IntegrationRequest integration_request;
+    IntegrationRequest* integration_requests;
+    size_t request_count;
     Socket socket;
+    // The client wants progress frames before the response
+    bool stream;
+    // Seconds from a connection being ready to it being accepted,
+    // and from then on until its requests have been received
+    double accept_time;
+    double recieve_time;
 } RequestInfo;
 
 int ServerRecieve(const ListenInfo* linfo, RequestInfo* rinfo_out);
 
+void ServerFreeRequest(RequestInfo* rinfo);
+
 typedef struct {
-    IntegrationResponse integration_response;
+    const IntegrationResponse* integration_responses;
+    size_t response_count;
     Socket socket;
 } ResponseInfo;
 
+// Sends the final responses and closes the connection
 int ServerRespond(const ResponseInfo* rinfo);
 
+// Sends partial results, fails once the client has gone away
+int ServerSendProgress(const ResponseInfo* rinfo);
+
+// Checks without blocking whether the client has closed its connection
+bool ServerClientGone(const RequestInfo* rinfo);
+
 void ServerRespondError(const RequestInfo* rinfo);
 
 typedef struct {
     Socket socket;
-    DiscoveryResponse response;
 } DiscoveryInfo;
 
 int ServerStartDiscovery(unsigned short discovery_port, DiscoveryInfo* dinfo_out);
 
-int ServerProcessDiscoveryRequest(const DiscoveryInfo* dinfo);
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_sz;
+} DiscoveryPeer;
+
+int ServerRecieveDiscoveryRequest(const DiscoveryInfo* dinfo, DiscoveryPeer* peer_out);
+
+int ServerRespondDiscovery(
+    const DiscoveryInfo* dinfo, const DiscoveryPeer* peer, const DiscoveryResponse* dresp
+);
+
+typedef struct {
+    Socket socket;
+} StatsInfo;
+
+// Listens on loopback only
+int ServerStartStats(unsigned short stats_port, StatsInfo* sinfo_out);
+
+// Waits for a connection to the stats socket
+int ServerAcceptStats(const StatsInfo* sinfo, Socket* socket_out);
+
+// Sends a report to a stats connection and closes it
+int ServerSendStats(Socket socket, const char* report, size_t report_sz);
 
 #ifdef __cplusplus
 }
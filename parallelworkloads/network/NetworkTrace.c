@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+#include "NetworkTrace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <iso646.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    uint64_t    ts_ns;
+    const char* name;
+    int64_t     arg;
+    char        phase;
+} TraceEvent;
+
+// Rings are never freed, so the events of finished threads can still be dumped
+typedef struct TraceRing {
+    struct TraceRing*   next;
+    pid_t               tid;
+    // Number of events ever recorded, only written by the owning thread
+    uint64_t            head;
+    TraceEvent          events[NET_TRACE_RING_SIZE];
+} TraceRing;
+
+static pthread_mutex_t rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing* rings = NULL;
+static __thread TraceRing* thread_ring = NULL;
+
+static TraceRing* AttachRing(void) {
+    TraceRing* ring = malloc(sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->tid = syscall(SYS_gettid);
+    ring->head = 0;
+    pthread_mutex_lock(&rings_mtx);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mtx);
+    thread_ring = ring;
+    return ring;
+}
+
+// Keeps errno, so events can be recorded between a call and its error check
+void netTraceEvent(char phase, const char* name, int64_t arg) {
+    int saved_errno = errno;
+    TraceRing* ring = thread_ring ? thread_ring: AttachRing();
+    if (!ring) {
+        errno = saved_errno;
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t head = ring->head;
+    TraceEvent* e = &ring->events[head % NET_TRACE_RING_SIZE];
+    e->ts_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    e->name = name;
+    e->arg = arg;
+    e->phase = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+int netTraceDump(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        return -1;
+    }
+    pid_t pid = getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+    pthread_mutex_lock(&rings_mtx);
+    for (TraceRing* ring = rings; ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t start = head > NET_TRACE_RING_SIZE ? head - NET_TRACE_RING_SIZE: 0;
+        for (uint64_t i = start; i < head; i++) {
+            const TraceEvent* e = &ring->events[i % NET_TRACE_RING_SIZE];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRIu64 ".%03" PRIu64
+                ",\"pid\":%d,\"tid\":%d,%s\"args\":{\"arg\":%" PRId64 "}}",
+                first ? "": ",", e->name, e->phase, e->ts_ns / 1000, e->ts_ns % 1000,
+                (int)pid, (int)ring->tid, e->phase == 'i' ? "\"s\":\"t\",": "", e->arg);
+            first = false;
+        }
+    }
+    pthread_mutex_unlock(&rings_mtx);
+    fprintf(f, "\n]}\n");
+    return fclose(f) ? -1: 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+
+#ifndef NETTRACE
+#define NETTRACE 0
+#endif
+
+// Every thread records timestamped events into its own ring buffer,
+// the oldest events are overwritten once it is full. Recording takes
+// no locks and no system calls after a thread's first event.
+enum {
+    NET_TRACE_RING_SIZE = 1 << 16,
+};
+
+// Names must be string literals, the trace keeps only the pointer
+void netTraceEvent(char phase, const char* name, int64_t arg);
+
+// Write the events of all threads as a Chrome trace JSON file, which
+// Perfetto opens too. Timestamps come from CLOCK_REALTIME so traces
+// of different hosts line up. Events recorded during the dump may be torn.
+int netTraceDump(const char* path);
+
+// With NETTRACE off the macros do not evaluate their arguments
+#if NETTRACE
+#define NetTraceBegin(name, arg)    netTraceEvent('B', name, arg)
+#define NetTraceEnd(name, arg)      netTraceEvent('E', name, arg)
+#define NetTraceInstant(name, arg)  netTraceEvent('i', name, arg)
+#else
+#define NetTraceBegin(name, arg)    ((void)0)
+#define NetTraceEnd(name, arg)      ((void)0)
+#define NetTraceInstant(name, arg)  ((void)0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
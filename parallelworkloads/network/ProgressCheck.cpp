@@ -0,0 +1,145 @@
+// This program checks that TrapezoidServer keeps a streaming client informed
+// while it computes a request too large to be answered from its cache:
+// it starts a server, sends it a single such request and fails unless
+// progress frames arrive regularly and the final response covers every point.
+//
+// Usage: ProgressCheck [-d bin_dir] [-t server_threads] [-s seconds]
+//   -s   how long the request should take the server, it is never smaller
+//        than twice the part of a request the server looks up in its cache
+#include "NetworkClient.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+// max_request_blocks * cache_block_n in TrapezoidServer
+constexpr size_t server_cached_n = size_t(256) << 20;
+// The server sends progress every 0.5s, allow for a slow machine
+constexpr double max_progress_gap_s = 5.0;
+// The server measures its throughput before it answers discovery
+constexpr double server_start_timeout_s = 60.0;
+
+double Seconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1e9;
+}
+
+struct ProgressLog {
+    std::chrono::steady_clock::time_point last;
+    double max_gap_s = 0.0;
+    size_t frames = 0;
+    size_t evaluations = 0;
+};
+
+int RecordProgress(const IntegrationResponse* partial, size_t count, void* data) {
+    auto* log = static_cast<ProgressLog*>(data);
+    auto now = std::chrono::steady_clock::now();
+    log->max_gap_s = std::max(log->max_gap_s, Seconds(now - log->last));
+    log->last = now;
+    log->frames++;
+    log->evaluations = count ? partial[0].evaluations: 0;
+    return 0;
+}
+
+pid_t StartServer(const std::string& path, const std::string& threads) {
+    pid_t pid = fork();
+    if (!pid) {
+        execl(path.c_str(), path.c_str(), threads.c_str(), (char*) nullptr);
+        perror("Failed to run TrapezoidServer");
+        exit(-1);
+    }
+    return pid;
+}
+
+double WaitForServer() {
+    auto start = std::chrono::steady_clock::now();
+    while (Seconds(std::chrono::steady_clock::now() - start) < server_start_timeout_s) {
+        if (double throughput = ClientGetThroughput()) {
+            return throughput;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    return 0.0;
+}
+
+int RunCheck(double throughput, double seconds) {
+    IntegrationRequest ireq = {};
+    ireq.l = 0.0;
+    ireq.r = 1e6;
+    ireq.n = std::max<size_t>(2 * server_cached_n + 1, throughput * seconds);
+
+    ProgressLog log;
+    log.last = std::chrono::steady_clock::now();
+    IntegrationResponse iresp = {};
+    if (ClientSendStream(&ireq, 1, &iresp, RecordProgress, &log)) {
+        std::cerr << "Request failed\n";
+        return -1;
+    }
+    double tail_s = Seconds(std::chrono::steady_clock::now() - log.last);
+    log.max_gap_s = std::max(log.max_gap_s, tail_s);
+
+    std::cout << "n " << ireq.n << ": " << log.frames << " progress frames, "
+              << "the last at " << log.evaluations << " points, longest silence " << log.max_gap_s << "s, "
+              << iresp.evaluations << " evaluations in " << iresp.compute_time << "s\n";
+    int rc = 0;
+    if (!log.frames) {
+        std::cerr << "No progress frames arrived\n";
+        rc = -1;
+    }
+    if (log.max_gap_s > max_progress_gap_s) {
+        std::cerr << "The server was silent for more than " << max_progress_gap_s << "s\n";
+        rc = -1;
+    }
+    if (iresp.evaluations != ireq.n + 1) {
+        std::cerr << "Expected " << ireq.n + 1 << " evaluations\n";
+        rc = -1;
+    }
+    return rc;
+}
+}
+
+int main(int argc, char* argv[]) {
+    std::string bin_dir = ".";
+    std::string threads = "1";
+    double seconds = 4.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:t:s:")) != -1) {
+        switch (opt) {
+        case 'd':
+            bin_dir = optarg;
+            break;
+        case 't':
+            threads = optarg;
+            break;
+        case 's':
+            seconds = strtod(optarg, nullptr);
+            break;
+        default:
+            std::cerr << "Usage: ProgressCheck [-d bin_dir] [-t server_threads] [-s seconds]\n";
+            return -1;
+        }
+    }
+
+    pid_t server = StartServer(bin_dir + "/TrapezoidServer", threads);
+    if (server < 0) {
+        perror("Failed to start TrapezoidServer");
+        return -1;
+    }
+    int rc = -1;
+    if (double throughput = WaitForServer()) {
+        rc = RunCheck(throughput, seconds);
+    } else {
+        std::cerr << "Failed to find the server\n";
+    }
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+    return rc;
+}
@@ -1,21 +1,71 @@
 #include "ScheduleTrapezoid.hpp"
 
+#include <algorithm>
 #include <cmath>
 #include <thread>
 #include <system_error>
 
-float launchIntegrate(float a, float b, size_t n) {
-    auto f = [](float x) { return std::exp(-x*x/2.0f); };
-    return trapezoidIntegrate(f, a, b , n);
+bool StopCondition::reached() const {
+    if (flag and flag->load(std::memory_order_relaxed)) {
+        return true;
+    }
+    return deadline != std::chrono::steady_clock::time_point::max() and
+           std::chrono::steady_clock::now() >= deadline;
+}
+
+// Points and sums are kept in double, the integrand is still evaluated in float
+void IntegrationProgress::store(const TrapezoidEstimate& est) {
+    s.store(est.s, std::memory_order_relaxed);
+    error.store(est.error, std::memory_order_relaxed);
+    evaluations.store(est.evaluations, std::memory_order_relaxed);
 }
 
-float scheduleIntegrate(
-    float l, float r,
+TrapezoidEstimate IntegrationProgress::load() const {
+    TrapezoidEstimate est;
+    est.s = s.load(std::memory_order_relaxed);
+    est.error = error.load(std::memory_order_relaxed);
+    est.evaluations = evaluations.load(std::memory_order_relaxed);
+    return est;
+}
+
+TrapezoidEstimate launchIntegrate(
+    double a, double b, size_t n, const StopCondition& stop, IntegrationProgress* progress
+) {
+    auto f = [](double x) { float xf = x; return std::exp(-xf*xf/2.0f); };
+    // Chunks have an even number of intervals, so the half resolution sum
+    // pairs the same points as it would over the whole range
+    constexpr size_t chunk_n = size_t(1) << 16;
+    if (!n) {
+        return trapezoidEstimate(f, a, b, n);
+    }
+
+    TrapezoidEstimate est = {};
+    double step = (b - a) / n;
+    for (size_t i = 0; i < n and !stop.reached(); i += chunk_n) {
+        size_t this_n = std::min(chunk_n, n - i);
+        double chunk_a = a + i * step;
+        double chunk_b = i + this_n == n ? b: a + (i + this_n) * step;
+        auto chunk = trapezoidEstimate(f, chunk_a, chunk_b, this_n);
+        est.s += chunk.s;
+        est.error += chunk.error;
+        // Neighbouring chunks share their boundary point
+        est.evaluations += chunk.evaluations - (i ? 1: 0);
+        if (progress) {
+            progress->store(est);
+        }
+    }
+    return est;
+}
+
+TrapezoidEstimate scheduleIntegrate(
+    double l, double r,
     size_t n, size_t n_threads,
-    const CPUTopology& topology
+    const CPUTopology& topology,
+    const StopCondition& stop
 ) {
-    constexpr auto step = 1024;
-    std::vector<float> results(n_threads * step);
+    // Keep every thread's result on its own page
+    constexpr auto step = 4096 / sizeof(TrapezoidEstimate);
+    std::vector<TrapezoidEstimate> results(n_threads * step);
     auto dist = distributeWork(topology, n, n_threads);
     std::vector<std::thread> threads(dist.size());
 
@@ -25,6 +75,10 @@ float scheduleIntegrate(
     for (size_t i = 0, current_n = 0; i < threads.size(); i++) {
         auto ids = std::get<0>(dist[i]);
         auto thread_n = std::get<1>(dist[i]);
+        // distributeWork rounds shares down, the last thread takes what is left
+        if (i == threads.size() - 1) {
+            thread_n = n - current_n;
+        }
 
         auto out = &results[i * step];
 
@@ -36,9 +90,9 @@ float scheduleIntegrate(
                 CPU_SET(ids.second, &msk);
                 pthread_setaffinity_np(pthread_self(), sizeof(msk), &msk);
             }
-            float a = l + (r - l) * current_n / n;
-            float b = a + (r - l) * thread_n / n;
-            *out = launchIntegrate(a, b, thread_n);
+            double a = l + (r - l) * current_n / n;
+            double b = l + (r - l) * (current_n + thread_n) / n;
+            *out = launchIntegrate(a, b, thread_n, stop);
         });
 
         current_n += thread_n;
@@ -53,11 +107,15 @@ float scheduleIntegrate(
         throw e;
     }
 
-    float s = 0.0f;
-    for (size_t i = 0; i < n_threads; i++) {
+    TrapezoidEstimate est = {};
+    for (size_t i = 0; i < threads.size(); i++) {
         threads[i].join();
-        s += results[i * step];
+        const auto& res = results[i * step];
+        est.s += res.s;
+        est.error += res.error;
+        // Neighbouring threads share their boundary point
+        est.evaluations += res.evaluations - (est.evaluations and res.evaluations ? 1: 0);
     }
 
-    return s;
+    return est;
 }
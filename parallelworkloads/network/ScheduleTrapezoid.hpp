@@ -2,10 +2,39 @@
 #include "CPUTopology.hpp"
 #include "TrapezoidIntegrator.hpp"
 
-float launchIntegrate(float a, float b, size_t n);
+#include <atomic>
+#include <chrono>
 
-float scheduleIntegrate(
-    float l, float r,
+// Integrations check this between chunks and stop once the flag
+// is set or the deadline has passed. A stopped estimate covers only
+// part of the range, so it has fewer than n + 1 evaluations.
+struct StopCondition {
+    const std::atomic<bool>* flag = nullptr;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+    bool reached() const;
+};
+
+// Running sums of an integration, stored after every chunk so other
+// threads can see how far it has got. The fields are stored one by one,
+// a reader may see a chunk counted in some of them but not yet in others.
+struct IntegrationProgress {
+    std::atomic<double> s{0.0};
+    std::atomic<double> error{0.0};
+    std::atomic<size_t> evaluations{0};
+
+    void store(const TrapezoidEstimate& est);
+    TrapezoidEstimate load() const;
+};
+
+TrapezoidEstimate launchIntegrate(
+    double a, double b, size_t n, const StopCondition& stop = StopCondition(),
+    IntegrationProgress* progress = nullptr
+);
+
+TrapezoidEstimate scheduleIntegrate(
+    double l, double r,
     size_t n, size_t n_threads,
-    const CPUTopology& topology = getSysCPUTopology()
+    const CPUTopology& topology = getSysCPUTopology(),
+    const StopCondition& stop = StopCondition()
 );
@@ -0,0 +1,130 @@
+#include "ServerMetrics.hpp"
+#include "IntegrationCache.hpp"
+#include "IntegrationPool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <utility>
+
+unsigned LatencyHistogram::bucketIndex(uint64_t ns) {
+    if (ns < sub_bucket_count) {
+        return ns;
+    }
+    // Keep the top sub_bucket_bits + 1 bits of the value
+    unsigned shift = 63 - __builtin_clzll(ns) - sub_bucket_bits;
+    return shift * sub_bucket_count + (ns >> shift);
+}
+
+uint64_t LatencyHistogram::bucketValue(unsigned idx) {
+    if (idx < 2 * sub_bucket_count) {
+        return idx;
+    }
+    unsigned shift = idx / sub_bucket_count - 1;
+    uint64_t first = uint64_t(idx - shift * sub_bucket_count) << shift;
+    return first + (uint64_t(1) << shift) / 2;
+}
+
+LatencyHistogram::LatencyHistogram()
+    : m_count(0), m_sum_ns(0), m_max_ns(0)
+{
+    for (auto& c: m_counts) {
+        c.store(0, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::record(double seconds) {
+    uint64_t ns = seconds > 0.0 ? uint64_t(seconds * 1e9): 0;
+    m_counts[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    auto max = m_max_ns.load(std::memory_order_relaxed);
+    while (ns > max and !m_max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t LatencyHistogram::getCount() const {
+    return m_count.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::getMean() const {
+    auto count = getCount();
+    return count ? m_sum_ns.load(std::memory_order_relaxed) / 1e9 / count: 0.0;
+}
+
+double LatencyHistogram::getMax() const {
+    return m_max_ns.load(std::memory_order_relaxed) / 1e9;
+}
+
+double LatencyHistogram::getPercentile(double q) const {
+    // Buckets may be updated while we read them, so count them again
+    uint64_t count = 0;
+    for (const auto& c: m_counts) {
+        count += c.load(std::memory_order_relaxed);
+    }
+    if (!count) {
+        return 0.0;
+    }
+    auto target = std::max<uint64_t>(1, std::ceil(q * count));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < bucket_count; i++) {
+        seen += m_counts[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            return std::min(bucketValue(i) / 1e9, getMax());
+        }
+    }
+    return getMax();
+}
+
+std::string ServerMetrics::report(const IntegrationPool& pool, IntegrationCache& cache) const {
+    auto uptime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start
+    ).count() / 1e9;
+
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(3);
+    ss << "uptime_s " << uptime << "\n";
+    auto counter = [&](const char* name, const std::atomic<uint64_t>& c) {
+        ss << name << " " << c.load(std::memory_order_relaxed) << "\n";
+    };
+    counter("discovery_requests", discovery_requests);
+    counter("connections", connections);
+    counter("recieve_errors", recieve_errors);
+    counter("requests", requests);
+    counter("segments", segments);
+    counter("computed_segments", computed_segments);
+    counter("progress_frames", progress_frames);
+    counter("abandoned", abandoned);
+    counter("timed_out", timed_out);
+    counter("respond_errors", respond_errors);
+    ss << "cache_hits " << cache.getHitCount() << "\n";
+    ss << "cache_misses " << cache.getMissCount() << "\n";
+    ss << "cache_entries " << cache.getSize() << "\n";
+    ss << "pool_queued " << pool.getQueuedCount() << "\n";
+    ss << "pool_active " << pool.getActiveCount() << "\n";
+    ss << "pool_throughput_per_s " << pool.getThroughput() << "\n";
+    auto busy = pool.getThreadBusyTimes();
+    for (size_t i = 0; i < busy.size(); i++) {
+        ss << "thread_" << i << "_utilization " << (uptime > 0.0 ? busy[i] / uptime: 0.0) << "\n";
+    }
+
+    auto histogram = [&](const char* name, const LatencyHistogram& h) {
+        ss << name << "_count " << h.getCount() << "\n";
+        ss << name << "_mean_us " << h.getMean() * 1e6 << "\n";
+        static const std::pair<const char*, double> percentiles[] = {
+            { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 },
+        };
+        for (const auto& p: percentiles) {
+            ss << name << "_" << p.first << "_us " << h.getPercentile(p.second) * 1e6 << "\n";
+        }
+        ss << name << "_max_us " << h.getMax() * 1e6 << "\n";
+    };
+    histogram("accept", accept);
+    histogram("recieve", recieve);
+    histogram("queue", queue);
+    histogram("compute", compute);
+    histogram("respond", respond);
+    histogram("total", total);
+    return ss.str();
+}
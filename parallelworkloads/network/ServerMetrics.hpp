@@ -0,0 +1,77 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+class IntegrationCache;
+class IntegrationPool;
+
+// Log-linear histogram of durations like HdrHistogram: every power of two
+// of nanoseconds is split into 16 buckets, so percentiles are off by at
+// most 1/16 of their value. Recording is lock-free and wait-free.
+class LatencyHistogram {
+    static constexpr unsigned sub_bucket_bits = 4;
+    static constexpr unsigned sub_bucket_count = 1u << sub_bucket_bits;
+    // Enough buckets for every 64 bit value
+    static constexpr unsigned bucket_count = (64 - sub_bucket_bits + 1) * sub_bucket_count;
+
+    std::array<std::atomic<uint64_t>, bucket_count> m_counts;
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum_ns;
+    std::atomic<uint64_t> m_max_ns;
+
+    static unsigned bucketIndex(uint64_t ns);
+    // Middle of the range of values that fall into the bucket
+    static uint64_t bucketValue(unsigned idx);
+
+public:
+    LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(double seconds);
+
+    uint64_t getCount() const;
+    double getMean() const;
+    double getMax() const;
+    // Smallest recorded duration that q of all durations do not exceed
+    double getPercentile(double q) const;
+};
+
+inline void addCount(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Everything the server counts and times while it runs,
+// cheap enough to be updated on every request
+struct ServerMetrics {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::atomic<uint64_t> discovery_requests{0};
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> recieve_errors{0};
+    // Integration requests in all received batches
+    std::atomic<uint64_t> requests{0};
+    // Blocks of the requests and the ones that were not cached
+    std::atomic<uint64_t> segments{0};
+    std::atomic<uint64_t> computed_segments{0};
+    std::atomic<uint64_t> progress_frames{0};
+    // Batches whose client went away before the response
+    std::atomic<uint64_t> abandoned{0};
+    std::atomic<uint64_t> timed_out{0};
+    std::atomic<uint64_t> respond_errors{0};
+
+    LatencyHistogram accept;
+    LatencyHistogram recieve;
+    // Time blocks wait in the pool before a thread starts them
+    LatencyHistogram queue;
+    LatencyHistogram compute;
+    LatencyHistogram respond;
+    LatencyHistogram total;
+
+    // Plain text report with one value per line
+    std::string report(const IntegrationPool& pool, IntegrationCache& cache) const;
+};
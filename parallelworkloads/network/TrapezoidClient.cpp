@@ -1,25 +1,164 @@
 #include "NetworkClient.h"
+#include "ScheduleTrapezoid.hpp"
 
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
+#include <system_error>
+#include <thread>
+
+namespace {
+// Requests this host can finish faster than this are not sent to workers
+constexpr double local_only_s = 0.01;
+// Minimum duration of the local throughput benchmark
+constexpr double local_benchmark_s = 0.01;
+
+double Seconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1e9;
+}
+
+double MeasureLocalThroughput(size_t n_threads, const CPUTopology& topology) {
+    size_t n = 1 << 16;
+    while (true) {
+        auto t0 = std::chrono::steady_clock::now();
+        scheduleIntegrate(0.0, n / 1000.0, n, n_threads, topology);
+        auto d = Seconds(std::chrono::steady_clock::now() - t0);
+        if (d >= local_benchmark_s) {
+            return n / d;
+        }
+        n *= 4;
+    }
+}
+
+IntegrationResponse IntegrateLocal(
+    const IntegrationRequest& ireq, size_t n_threads, const CPUTopology& topology
+) {
+    IntegrationResponse iresp = {};
+    if (ireq.n) {
+        auto t0 = std::chrono::steady_clock::now();
+        NetTraceBegin("local_integrate", ireq.n);
+        auto est = scheduleIntegrate(ireq.l, ireq.r, ireq.n, n_threads, topology);
+        NetTraceEnd("local_integrate", est.evaluations);
+        iresp.compute_time = Seconds(std::chrono::steady_clock::now() - t0);
+        iresp.ival = est.s;
+        iresp.error = est.error;
+        iresp.evaluations = est.evaluations;
+    }
+    return iresp;
+}
+
+// Show how far the workers have got with each request of a remote batch
+int PrintProgress(const IntegrationResponse* partial, size_t count, void* data) {
+    const auto* ireqs = static_cast<const IntegrationRequest*>(data);
+    for (size_t i = 0; i < count; i++) {
+        if (count > 1) {
+            std::cerr << "Request " << i << ": ";
+        }
+        std::cerr << "Integrated " << partial[i].evaluations << " of " << ireqs[i].n + 1
+                  << " points, partial sum " << partial[i].ival << "\n";
+    }
+    return 0;
+}
+
+// Count this host as one more worker: integrate its share of the range
+// while the workers integrate the rest, and take over their share if they fail
+int IntegrateHybrid(const IntegrationRequest& ireq, IntegrationResponse& iresp) {
+    auto topology = getSysCPUTopology();
+    size_t n_threads = std::thread::hardware_concurrency();
+
+    auto local_throughput = MeasureLocalThroughput(n_threads, topology);
+    if (ireq.n / local_throughput < local_only_s) {
+        std::cerr << "Integrate locally\n";
+        iresp = IntegrateLocal(ireq, n_threads, topology);
+        return 0;
+    }
+
+    auto remote_throughput = ClientGetThroughput();
+    size_t local_n = ireq.n * (local_throughput / (local_throughput + remote_throughput));
+    double split = ireq.l + (ireq.r - ireq.l) * local_n / ireq.n;
+    IntegrationRequest local_ireq { ireq.l, split, local_n, ireq.timeout };
+    IntegrationRequest remote_ireq { split, ireq.r, ireq.n - local_n, ireq.timeout };
+    std::cerr << "Integrate " << local_n << " points locally and "
+              << remote_ireq.n << " remotely\n";
+
+    IntegrationResponse remote_iresp = {};
+    int remote_r = 0;
+    std::thread remote_thread;
+    if (remote_ireq.n) {
+        remote_thread = std::thread([&] {
+            remote_r = ClientSend(&remote_ireq, &remote_iresp);
+        });
+    }
+    auto local_iresp = IntegrateLocal(local_ireq, n_threads, topology);
+    if (remote_thread.joinable()) {
+        remote_thread.join();
+    }
+    if (remote_r) {
+        std::cerr << "Failed to recieve integration request response, integrate locally\n";
+        remote_iresp = IntegrateLocal(remote_ireq, n_threads, topology);
+    }
+
+    iresp.ival = local_iresp.ival + remote_iresp.ival;
+    iresp.error = local_iresp.error + remote_iresp.error;
+    // Both parts evaluate the split point
+    iresp.evaluations = local_iresp.evaluations + remote_iresp.evaluations -
+        (local_iresp.evaluations and remote_iresp.evaluations ? 1: 0);
+    iresp.compute_time = std::max(local_iresp.compute_time, remote_iresp.compute_time);
+    return 0;
+}
+
+// Set NETTRACE_FILE to get a trace of the run
+void DumpTrace() {
+    if (auto path = getenv("NETTRACE_FILE")) {
+        if (netTraceDump(path)) {
+            std::cerr << "Failed to write trace to " << path << "\n";
+        }
+    }
+}
+}
 
 int main(int argc, char* argv[]) {
     argc--;
     argv++;
+    std::atexit(DumpTrace);
 
-    constexpr auto l = 0.0f, r = 1000000.0f;
+    constexpr auto l = 0.0, r = 1000000.0;
     size_t n = 5ull * 1000 * 1000 * 1000;
     if (argv[0]) {
         std::stringstream ss(argv[0]);
         ss >> n;
     }
+    bool hybrid = true;
+    if (argv[0] and argv[1]) {
+        if (!strcmp(argv[1], "remote")) {
+            hybrid = false;
+        } else if (strcmp(argv[1], "hybrid")) {
+            std::cerr << "Mode must be remote or hybrid\n";
+            return -1;
+        }
+    }
 
-    IntegrationRequest ireq { l, r, n };
+    // No deadline, the client waits for the whole range
+    IntegrationRequest ireq { l, r, n, 0.0 };
     IntegrationResponse iresp;
-    if (auto r = ClientSend(&ireq, &iresp)) {
+    if (hybrid) {
+        try {
+            IntegrateHybrid(ireq, iresp);
+        } catch (const std::system_error& e) {
+            std::cerr << "Failed to start local compute threads\n";
+            return -1;
+        }
+    } else if (auto r = ClientSendStream(&ireq, 1, &iresp, PrintProgress, &ireq)) {
         std::cerr << "Failed to recieve integration request response\n";
         return -1;
     }
 
-    std::cout << iresp.ival << "\n";
+    std::cerr << "Error estimate " << iresp.error << ", "
+              << iresp.evaluations << " evaluations in "
+              << iresp.compute_time << "s\n";
+    std::cout << std::setprecision(std::numeric_limits<double>::digits10) << iresp.ival << "\n";
 }
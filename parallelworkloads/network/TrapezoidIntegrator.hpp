@@ -17,3 +17,35 @@ float trapezoidIntegrate(F f, float a, float b, size_t n) {
     }
     return s;
 }
+
+struct TrapezoidEstimate {
+    double s;
+    // Richardson estimate of the error of s
+    double error;
+    size_t evaluations;
+};
+
+// Trapezoid rule that also sums every other point to get the same integral
+// with half the intervals, the difference between the two estimates the error
+template<typename F>
+TrapezoidEstimate trapezoidEstimate(F f, double a, double b, size_t n) {
+    double s = 0.0;
+    double s_half = 0.0;
+    auto step = (b - a) / n;
+    auto f_c = f(a);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        auto f_m = f(a + (i + 1) * step);
+        auto f_n = f(a + (i + 2) * step);
+        s += (f_c + 2.0 * f_m + f_n) / 2.0 * step;
+        s_half += (f_c + f_n) * step;
+        f_c = f_n;
+    }
+    if (i < n) {
+        auto f_n = f(b);
+        auto t = (f_n + f_c) / 2.0 * step;
+        s += t;
+        s_half += t;
+    }
+    return {s, (s - s_half) / 3.0, n + 1};
+}
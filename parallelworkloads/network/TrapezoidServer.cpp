@@ -1,35 +1,98 @@
-#include "ScheduleTrapezoid.hpp"
+#include "IntegrationCache.hpp"
+#include "IntegrationPool.hpp"
+#include "ServerMetrics.hpp"
 #include "NetworkServer.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <sstream>
+#include <string>
 #include <system_error>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <csignal>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace {
-double RunBenchmark(size_t n_threads, const CPUTopology& topology) {
+// Intervals in a cached block, about 10ms of work for a single thread
+constexpr size_t cache_block_n = size_t(1) << 20;
+// Each cached block takes roughly 100 bytes
+constexpr size_t cache_capacity = size_t(1) << 16;
+// Cached blocks looked up per request, so planning a batch of MAX_FRAME_RECORDS
+// requests takes at most some tens of megabytes. The rest of a larger request
+// is computed in uncached tasks that are only created as the queue drains.
+constexpr size_t max_request_blocks = 256;
+// Intervals in each of those uncached tasks
+constexpr size_t uncached_task_n = size_t(1) << 24;
+// Blocks queued in the pool at once while a batch is computed
+constexpr size_t max_queued_tasks = 16;
+// Streaming clients get partial results this often
+constexpr double progress_period_s = 0.5;
+// How often to check whether the client is still there while computing
+constexpr std::chrono::milliseconds client_check_period(10);
+
+double Seconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1e9;
+}
+
+// Seed the pool's throughput estimate before anyone can discover us
+void RunBenchmark(IntegrationPool& pool) {
     NetDebugPrint("Start throughput benchmark\n");
     size_t n = 100 * 1000 * 1000;
-    double t, d;
+    double d;
     do {
         auto t0 = std::chrono::steady_clock::now();
-        float l = 0.0f;
-        float r = (l + n) / 1000.0f;
-        scheduleIntegrate(l, r, n, n_threads, topology);
+        double l = 0.0;
+        double r = (l + n) / 1000.0;
+        pool.integrate(l, r, n);
         auto t1 = std::chrono::steady_clock::now();
-        d = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count() / 1e9;
-        t = n / d;
+        d = Seconds(t1 - t0);
         n *= 2;
     } while(d < 1.0);
     NetDebugPrint("Finished throughput benchmark\n");
-    return t;
 }
 
-void StartDiscoveryService(const DiscoveryInfo& dinfo) {
-    std::thread([dinfo] {
+// Report the pool's current throughput and load with every response
+DiscoveryResponse GenerateDiscoveryResponse(
+    const IntegrationPool& pool, const ListenInfo& linfo, unsigned instance
+) {
+    DiscoveryResponse dresp;
+    dresp.instance = instance;
+    dresp.port = linfo.instance_port;
+    dresp.props.thread_count = pool.getThreadCount();
+    dresp.props.throughput = pool.getThroughput();
+    dresp.props.queue_depth = pool.getQueuedCount();
+    dresp.props.active_jobs = pool.getActiveCount();
+    return dresp;
+}
+
+void StartDiscoveryService(
+    const DiscoveryInfo& dinfo, const IntegrationPool& pool,
+    const ListenInfo& linfo, unsigned instance, ServerMetrics& metrics
+) {
+    std::thread([dinfo, &pool, linfo, instance, &metrics] {
         bool quit = false;
         while(!quit) {
-            if (auto r = ServerProcessDiscoveryRequest(&dinfo)) {
+            DiscoveryPeer peer;
+            auto r = ServerRecieveDiscoveryRequest(&dinfo, &peer);
+            if (!r) {
+                addCount(metrics.discovery_requests);
+                auto dresp = GenerateDiscoveryResponse(pool, linfo, instance);
+                r = ServerRespondDiscovery(&dinfo, &peer, &dresp);
+            }
+            if (r) {
                 auto msg = "Failed to process discovery request";
                 if (r < 0) {
                     std::cerr << "FATAL: " << msg << "\n";
@@ -43,41 +106,295 @@ void StartDiscoveryService(const DiscoveryInfo& dinfo) {
     }).detach();
 }
 
-struct IntegrationResponseGen {
-    IntegrationResponse iresp;
-    bool valid = false;
+void StartStatsService(
+    const StatsInfo& sinfo, const IntegrationPool& pool,
+    IntegrationCache& cache, const ServerMetrics& metrics
+) {
+    std::thread([sinfo, &pool, &cache, &metrics] {
+        bool quit = false;
+        while(!quit) {
+            Socket s;
+            if (ServerAcceptStats(&sinfo, &s)) {
+                std::cerr << "TEMP: Failed to accept stats connection\n";
+                continue;
+            }
+            auto report = metrics.report(pool, cache);
+            if (ServerSendStats(s, report.data(), report.size())) {
+                std::cerr << "TEMP: Failed to send stats\n";
+            }
+        }
+    }).detach();
+}
 
-    explicit operator bool() const {
-        return valid;
+// Neumaier summation, a response can be the sum of thousands of blocks
+void CompensatedAdd(double& sum, double& c, double x) {
+    double t = sum + x;
+    if (std::fabs(sum) >= std::fabs(x)) {
+        c += (sum - t) + x;
+    } else {
+        c += (x - t) + sum;
     }
+    sum = t;
+}
 
-    IntegrationResponse& operator*() {
-        return iresp;
-    }
+// Called with the partial responses while a batch is computed,
+// returns false once nobody wants the results anymore
+using ProgressCallback = std::function<bool(const std::vector<IntegrationResponse>&)>;
+
+struct Segment {
+    IntegralKey key;
+    // Index of the task that computes the segment, no_task if it was cached
+    size_t task;
+    CachedIntegral value;
+};
+constexpr size_t no_task = size_t(-1);
+
+// Part of a request past its cached blocks
+struct Remainder {
+    double l, r;
+    size_t n;
+    std::chrono::steady_clock::time_point deadline;
+    // Intervals that tasks have been created for
+    size_t submitted;
+    // Sums of the tasks that are done
+    CachedIntegral value;
+    double compute_time;
+    // A task hit the deadline, so the rest is not worth starting
+    bool stopped;
 };
 
-IntegrationResponseGen GenerateIntegrationResponse(
-    const IntegrationRequest& ireq, size_t n_threads, const CPUTopology& topology
+std::chrono::steady_clock::time_point Deadline(
+    std::chrono::steady_clock::time_point start, double timeout
 ) {
-    float l = ireq.l;
-    float r = ireq.r;
-    size_t n = ireq.n;
-    IntegrationResponseGen ret;
-    try {
-        float ival =  scheduleIntegrate(l, r, n, n_threads, topology);
-        ret.valid = true;
-        ret.iresp.ival = ival;
-    } catch (const std::system_error& e) {}
-    return ret;
+    // Timeouts beyond a year would overflow the clock and are as good as none
+    if (!(timeout > 0.0) or timeout > 365 * 24 * 3600.0) {
+        return std::chrono::steady_clock::time_point::max();
+    }
+    return start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(timeout)
+    );
 }
 
-int ServerLoop(const ListenInfo& linfo, const DiscoveryInfo& dinfo, size_t n_threads, const CPUTopology& topology) {
-    StartDiscoveryService(dinfo);
+// Answer every request from cached blocks where possible and compute the
+// missing ones, then the parts of large requests past their cached blocks.
+// A few tasks are kept queued so the pool never waits for the next one,
+// but few enough to stop soon after the client has gone away.
+// A block shared by several requests runs until the last of their deadlines,
+// requests with a part that was stopped by its deadline get a NaN response.
+bool GenerateIntegrationResponses(
+    const RequestInfo& req_info, IntegrationPool& pool, IntegrationCache& cache,
+    ServerMetrics& metrics, const ProgressCallback& progress,
+    std::vector<IntegrationResponse>& iresps
+) {
+    auto count = req_info.request_count;
+    std::vector<std::vector<Segment>> segments(count);
+    std::vector<Remainder> remainders(count);
+    std::vector<IntegralKey> missing;
+    std::unordered_map<IntegralKey, size_t, IntegralKeyHash> missing_idx;
+    std::vector<std::chrono::steady_clock::time_point> deadlines;
+    auto start = std::chrono::steady_clock::now();
+    size_t segment_cnt = 0;
+    NetTraceBegin("plan", count);
+    for (size_t i = 0; i < count; i++) {
+        const auto& ireq = req_info.integration_requests[i];
+        auto deadline = Deadline(start, ireq.timeout);
+        size_t planned_n = 0;
+        double planned_r = ireq.l;
+        for (const auto& key: alignedSegments(ireq.l, ireq.r, ireq.n, cache_block_n, max_request_blocks)) {
+            Segment seg = { key, no_task, {} };
+            if (!cache.lookup(key, seg.value)) {
+                auto it = missing_idx.emplace(key, missing.size());
+                if (it.second) {
+                    missing.push_back(key);
+                    deadlines.push_back(deadline);
+                }
+                seg.task = it.first->second;
+                deadlines[seg.task] = std::max(deadlines[seg.task], deadline);
+            }
+            segments[i].push_back(seg);
+            planned_n += key.n;
+            planned_r = key.r;
+        }
+        remainders[i] = { planned_r, ireq.r, ireq.n - planned_n, deadline, 0, {}, 0.0, false };
+        segment_cnt += segments[i].size();
+    }
+    NetTraceEnd("plan", missing.size());
+    NetDebugPrint("Compute %zu of %zu segments\n", missing.size(), segment_cnt);
+    addCount(metrics.segments, segment_cnt);
+    addCount(metrics.computed_segments, missing.size());
+
+    // Tasks for the missing blocks come first, then those for the remainders.
+    // A deque keeps the queued tasks in place while more are created.
+    std::deque<IntegrationTask> tasks;
+    // Request whose remainder each task is part of, no_task for blocks
+    std::vector<size_t> task_owners;
+    size_t next_remainder = 0;
+    // Stops the queued tasks once nobody wants the results anymore
+    std::atomic<bool> abandoned(false);
+    size_t done = 0;
+    // Creates and submits the next task, false once there is none left
+    auto submit_next = [&] {
+        size_t owner = no_task;
+        IntegralKey key;
+        std::chrono::steady_clock::time_point deadline;
+        if (tasks.size() < missing.size()) {
+            key = missing[tasks.size()];
+            deadline = deadlines[tasks.size()];
+        } else {
+            while (next_remainder < count and (remainders[next_remainder].stopped or
+                remainders[next_remainder].submitted == remainders[next_remainder].n
+            )) {
+                next_remainder++;
+            }
+            if (next_remainder == count) {
+                return false;
+            }
+            auto& rem = remainders[next_remainder];
+            size_t first = rem.submitted;
+            rem.submitted += std::min(uncached_task_n, rem.n - first);
+            auto point = [&](size_t i) { return i == rem.n ? rem.r: rem.l + (rem.r - rem.l) * i / rem.n; };
+            key = { point(first), point(rem.submitted), rem.submitted - first };
+            deadline = rem.deadline;
+            owner = next_remainder;
+        }
+        tasks.emplace_back();
+        auto& task = tasks.back();
+        task.l = key.l;
+        task.r = key.r;
+        task.n = key.n;
+        task.stop.flag = &abandoned;
+        task.stop.deadline = deadline;
+        task_owners.push_back(owner);
+        pool.submit(task);
+        return true;
+    };
+    // Sum the parts that are known so far, partial sums also include
+    // the chunks of the queued tasks that the pool has finished
+    auto sum = [&](bool partial) {
+        std::vector<CachedIntegral> running;
+        if (partial) {
+            for (size_t j = done; j < tasks.size(); j++) {
+                auto est = pool.getProgress(tasks[j]);
+                running.push_back({ est.s, est.error, est.evaluations });
+            }
+        }
+        iresps.assign(count, IntegrationResponse{});
+        for (size_t i = 0; i < count; i++) {
+            double ival = 0.0, c = 0.0;
+            bool timed_out = false;
+            auto& iresp = iresps[i];
+            auto add = [&](const CachedIntegral& value) {
+                CompensatedAdd(ival, c, value.result);
+                iresp.error += value.error;
+                // Neighbouring parts share their boundary point
+                iresp.evaluations += value.evaluations - (iresp.evaluations and value.evaluations ? 1: 0);
+            };
+            for (const auto& seg: segments[i]) {
+                auto value = seg.value;
+                if (seg.task != no_task) {
+                    if (seg.task >= done) {
+                        if (seg.task - done < running.size()) {
+                            add(running[seg.task - done]);
+                        }
+                        continue;
+                    }
+                    const auto& task = tasks[seg.task];
+                    timed_out = timed_out or task.stopped;
+                    value = { task.result, task.error, task.evaluations };
+                    iresp.compute_time += task.compute_time;
+                }
+                add(value);
+            }
+            const auto& rem = remainders[i];
+            add(rem.value);
+            for (size_t j = 0; j < running.size(); j++) {
+                if (task_owners[done + j] == i) {
+                    add(running[j]);
+                }
+            }
+            iresp.compute_time += rem.compute_time;
+            timed_out = timed_out or rem.stopped;
+
+            iresp.ival = ival + c;
+            if (timed_out and !partial) {
+                addCount(metrics.timed_out);
+            }
+            if (timed_out) {
+                iresp.ival = std::numeric_limits<double>::quiet_NaN();
+                iresp.error = std::numeric_limits<double>::quiet_NaN();
+            }
+        }
+    };
+
+    auto last_progress = start;
+    // Streaming clients hear from us every progress period, whether or not
+    // a task has finished since, so a single long task still shows progress
+    auto report = [&] {
+        auto now = std::chrono::steady_clock::now();
+        if (progress and !abandoned and Seconds(now - last_progress) >= progress_period_s) {
+            sum(true);
+            abandoned = !progress(iresps);
+            last_progress = now;
+        }
+    };
+    bool submitted_all = false;
+    while (true) {
+        while (!abandoned and !submitted_all and tasks.size() - done < max_queued_tasks) {
+            submitted_all = !submit_next();
+        }
+        if (done == tasks.size()) {
+            break;
+        }
+        while (!pool.wait(tasks[done], client_check_period)) {
+            if (!abandoned and ServerClientGone(&req_info)) {
+                NetDebugPrint("Client has gone away, stop computing\n");
+                abandoned = true;
+            }
+            report();
+        }
+        const auto& task = tasks[done];
+        metrics.queue.record(task.queue_time);
+        CachedIntegral value = { task.result, task.error, task.evaluations };
+        if (task_owners[done] == no_task) {
+            if (!task.stopped) {
+                cache.insert(missing[done], value);
+            }
+        } else {
+            auto& rem = remainders[task_owners[done]];
+            rem.value.result += value.result;
+            rem.value.error += value.error;
+            rem.value.evaluations += value.evaluations - (rem.value.evaluations and value.evaluations ? 1: 0);
+            rem.compute_time += task.compute_time;
+            rem.stopped = rem.stopped or task.stopped;
+        }
+        done++;
+
+        if (!(submitted_all and done == tasks.size())) {
+            report();
+        }
+    }
+
+    if (abandoned) {
+        return false;
+    }
+    sum(false);
+    return true;
+}
+
+int ServerLoop(
+    const ListenInfo& linfo, const DiscoveryInfo& dinfo, const StatsInfo& sinfo,
+    IntegrationPool& pool, unsigned instance
+) {
+    IntegrationCache cache(cache_capacity);
+    ServerMetrics metrics;
+    StartDiscoveryService(dinfo, pool, linfo, instance, metrics);
+    StartStatsService(sinfo, pool, cache, metrics);
 
     bool quit = false;
     while(!quit) {
         RequestInfo req_info;
         if (auto r = ServerRecieve(&linfo, &req_info)) {
+            addCount(metrics.recieve_errors);
             auto msg = "Failed to accept integration request";
             if (r < 0) {
                 std::cerr << "FATAL: " << msg << "\n";
@@ -88,19 +405,47 @@ int ServerLoop(const ListenInfo& linfo, const DiscoveryInfo& dinfo, size_t n_thr
             }
         }
 
-        auto iresp = GenerateIntegrationResponse(
-            req_info.integration_request, n_threads, topology
+        addCount(metrics.connections);
+        addCount(metrics.requests, req_info.request_count);
+        metrics.accept.record(req_info.accept_time);
+        metrics.recieve.record(req_info.recieve_time);
+
+        ProgressCallback progress;
+        if (req_info.stream) {
+            progress = [&](const std::vector<IntegrationResponse>& partial) {
+                ResponseInfo resp_info = {
+                    partial.data(), partial.size(), req_info.socket
+                };
+                addCount(metrics.progress_frames);
+                return !ServerSendProgress(&resp_info);
+            };
+        }
+        std::vector<IntegrationResponse> iresps;
+        auto t0 = std::chrono::steady_clock::now();
+        NetTraceBegin("batch", req_info.request_count);
+        bool finished = GenerateIntegrationResponses(
+            req_info, pool, cache, metrics, progress, iresps
         );
-        if (!iresp) {
+        NetTraceEnd("batch", finished);
+        auto t1 = std::chrono::steady_clock::now();
+        metrics.compute.record(Seconds(t1 - t0));
+        ServerFreeRequest(&req_info);
+        if (!finished) {
+            addCount(metrics.abandoned);
+            std::cerr << "TEMP: Client stopped waiting for integration response\n";
             ServerRespondError(&req_info);
-            std::cerr << "FATAL: Failed to integrate\n";
-            return -1;
+            continue;
         }
 
         ResponseInfo resp_info = {
-            *iresp, req_info.socket
+            iresps.data(), iresps.size(), req_info.socket
         };
-        if (auto r = ServerRespond(&resp_info)) {
+        auto r = ServerRespond(&resp_info);
+        auto t2 = std::chrono::steady_clock::now();
+        metrics.respond.record(Seconds(t2 - t1));
+        metrics.total.record(req_info.accept_time + req_info.recieve_time + Seconds(t2 - t0));
+        if (r) {
+            addCount(metrics.respond_errors);
             auto msg = "Failed to send integration response";
             if (r < 0) {
                 std::cerr << "FATAL: " << msg << "\n";
@@ -114,8 +459,98 @@ int ServerLoop(const ListenInfo& linfo, const DiscoveryInfo& dinfo, size_t n_thr
 
     return 0;
 }
+
+// Write the trace to /tmp/pw_trace_<pid>.json whenever SIGUSR1 arrives.
+// Must run before any other thread starts so they all inherit the blocked signal.
+void StartTraceDumper() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    std::thread([set] {
+        bool quit = false;
+        while (!quit) {
+            int sig;
+            if (sigwait(&set, &sig)) {
+                continue;
+            }
+            auto path = "/tmp/pw_trace_" + std::to_string(getpid()) + ".json";
+            if (netTraceDump(path.c_str())) {
+                std::cerr << "TEMP: Failed to write trace to " << path << "\n";
+            } else {
+                std::cerr << "Wrote trace to " << path << "\n";
+            }
+        }
+    }).detach();
 }
 
+int RunInstance(unsigned instance, size_t n_threads, const CPUTopology& topology) {
+    StartTraceDumper();
+    ListenInfo linfo;
+    if (ServerListen(CALCULATE_PORT_V, instance, &linfo) < 0) {
+        std::cerr << "FATAL: Failed to start listening on port " << CALCULATE_PORT
+                  << " for instance " << instance << "\n";
+        return -1;
+    }
+    DiscoveryInfo dinfo;
+    if (ServerStartDiscovery(DISCOVER_PORT_V, &dinfo) < 0) {
+        std::cerr << "FATAL: Failed to start discovery service on port " << DISCOVER_PORT << "\n";
+        return -1;
+    }
+    StatsInfo sinfo;
+    if (ServerStartStats(STATS_PORT_V + instance, &sinfo) < 0) {
+        std::cerr << "FATAL: Failed to start stats service on port " << STATS_PORT_V + instance << "\n";
+        return -1;
+    }
+    std::unique_ptr<IntegrationPool> pool;
+    try {
+        pool.reset(new IntegrationPool(n_threads, topology));
+    } catch (const std::system_error& e) {
+        std::cerr << "FATAL: Failed to start " << n_threads << " compute threads\n";
+        return -1;
+    }
+    RunBenchmark(*pool);
+    return ServerLoop(linfo, dinfo, sinfo, *pool, instance);
+}
+
+// Run one instance with n_threads threads on every NUMA node
+int RunNUMAInstances(size_t n_threads) {
+    auto nodes = getSysNUMANodes();
+    if (nodes.size() == 1) {
+        return RunInstance(0, n_threads, getSysCPUTopology());
+    }
+
+    for (unsigned instance = 0; instance < nodes.size(); instance++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "FATAL: Failed to start instance " << instance << "\n";
+            return -1;
+        } else if (!pid) {
+            // Keep the accept and discovery threads and all allocations on the node too
+            const auto& cpus = nodes[instance];
+            cpu_set_t msk;
+            CPU_ZERO(&msk);
+            for (auto id: cpus) {
+                CPU_SET(id, &msk);
+            }
+            sched_setaffinity(0, sizeof(msk), &msk);
+            exit(RunInstance(instance, n_threads, getSysCPUTopology(cpus)));
+        }
+    }
+
+    int ret = 0;
+    int status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) or WEXITSTATUS(status)) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+}
+
+// Usage: TrapezoidServer [n_threads] [numa]
+// With numa, one server with n_threads threads runs on every NUMA node
 int main(int argc, char* argv[]) {
     argc--;
     argv++;
@@ -128,25 +563,10 @@ int main(int argc, char* argv[]) {
         }
         return n_threads;
     } ();
+    bool numa = argv[0] and argv[1] and std::string(argv[1]) == "numa";
 
-    ListenInfo linfo;
-    if (ServerListen(CALCULATE_PORT_V, &linfo) < 0) {
-        std::cerr << "FATAL: Failed to start listening on port " << CALCULATE_PORT << "\n";
-        return -1;
-    }
-    DiscoveryInfo dinfo;
-    if (ServerStartDiscovery(DISCOVER_PORT_V, &dinfo) < 0) {
-        std::cerr << "FATAL: Failed to start discovery service on port " << DISCOVER_PORT << "\n";
-        return -1;
+    if (numa) {
+        return RunNUMAInstances(n_threads);
     }
-    auto topology = getSysCPUTopology();
-    dinfo.response.props.thread_count = n_threads;
-    try {
-        dinfo.response.props.throughput = RunBenchmark(n_threads, topology);
-    } catch (const std::system_error& e) {
-        std::cerr << "FATAL: Failed to run throughput benchmark\n";
-        return -1;
-    }
-    ServerLoop(linfo, dinfo, n_threads, topology);
-    return 0;
+    return RunInstance(0, n_threads, getSysCPUTopology());
 }
@@ -0,0 +1,220 @@
+// This program measures pipeline throughput on a large generated input
+// for each data path and a few chain lengths.
+//
+// Usage: pipeline_benchmark [-p pipeline] [-s size_mb] [-a budget_mb] [-e] [-t threads] [-i input] [n...]
+//   -a   also run every mode with adaptive buffer sizing
+//   -e   also run the copy and splice modes with the epoll relay, for example on
+//        n of 10 100 1000 10000 to see how the relays scale
+//   -t   run the relays on this many threads, 0 for one per core
+//   -i   read the input with read, mmap, sendfile or splice
+#include <errno.h>
+#include <fcntl.h>
+#include <iso646.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* modes[] = {
+    "copy",
+    "splice",
+    "shm",
+};
+
+static const char* relays[] = {
+    "poll",
+    "epoll",
+};
+
+// Fills the file with size_mb megabytes of incompressible bytes
+int writeInput(int fd, size_t size_mb) {
+    enum {BLOCK_SIZE = 1 << 20};
+    char* block = malloc(BLOCK_SIZE);
+    if (!block) {
+        return -1;
+    }
+    unsigned state = 1;
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        state = state * 1103515245 + 12345;
+        block[i] = state >> 16;
+    }
+    for (size_t i = 0; i < size_mb; i++) {
+        for (size_t total_write = 0; total_write < BLOCK_SIZE;) {
+            ssize_t num_write = write(fd, block + total_write, BLOCK_SIZE - total_write);
+            if (num_write < 0) {
+                free(block);
+                return -1;
+            }
+            total_write += num_write;
+        }
+    }
+    free(block);
+    return 0;
+}
+
+// Runs the pipeline with its stdout on a pipe and discards everything it
+// writes, so the run only ends once the last child has written all its input
+int runPipeline(char* const* args, size_t* size_ptr) {
+    int fildes[2];
+    if (pipe(fildes) < 0) {
+        perror("Failed to create output pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to create pipeline");
+        return -1;
+    }
+    if (!pid) {
+        close(fildes[0]);
+        if (dup2(fildes[1], STDOUT_FILENO) < 0) {
+            perror("Failed to redirect stdout");
+            exit(-1);
+        }
+        close(fildes[1]);
+        execv(args[0], args);
+        perror("Failed to run pipeline");
+        exit(-1);
+    }
+    close(fildes[1]);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        perror("Failed to open /dev/null");
+        return -1;
+    }
+    size_t size = 0;
+    ssize_t num_spliced = 0;
+    do {
+        num_spliced = splice(fildes[0], NULL, null_fd, NULL, 1 << 20, SPLICE_F_MOVE);
+        if (num_spliced > 0) {
+            size += num_spliced;
+        }
+    }
+    while (num_spliced > 0);
+    if (num_spliced < 0) {
+        perror("Failed to drain output");
+    }
+    close(null_fd);
+    close(fildes[0]);
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0 or !WIFEXITED(status) or WEXITSTATUS(status)) {
+        return -1;
+    }
+    *size_ptr = size;
+    return num_spliced < 0 ? -1: 0;
+}
+
+int main(int argc, char* argv[]) {
+    const char* pipeline = "./pipeline";
+    size_t size_mb = 2048;
+    const char* budget = NULL;
+    bool epoll = false;
+    const char* threads = NULL;
+    const char* input = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:a:et:i:")) != -1) {
+        switch (opt) {
+        case 'p':
+            pipeline = optarg;
+            break;
+        case 's':
+            size_mb = strtoull(optarg, NULL, 10);
+            break;
+        case 'a':
+            budget = optarg;
+            break;
+        case 'e':
+            epoll = true;
+            break;
+        case 't':
+            threads = optarg;
+            break;
+        case 'i':
+            input = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p pipeline] [-s size_mb] [-a budget_mb] [-e] [-t threads] [-i input] [n...]\n", argv[0]);
+            return -1;
+        }
+    }
+    static const char* default_ns[] = { "1", "2", "4", "16" };
+    const char** ns = (const char**) argv + optind;
+    size_t ns_count = argc - optind;
+    if (!ns_count) {
+        ns = default_ns;
+        ns_count = sizeof(default_ns) / sizeof(*default_ns);
+    }
+
+    const char* tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR"): "/tmp";
+    char file_name[PATH_MAX];
+    snprintf(file_name, sizeof(file_name), "%s/pipeline_benchmark_XXXXXX", tmp_dir);
+    int fd = mkstemp(file_name);
+    if (fd < 0) {
+        perror("Failed to create input file");
+        return -1;
+    }
+    fprintf(stderr, "Write %zu MB to %s\n", size_mb, file_name);
+    int rc = writeInput(fd, size_mb);
+    close(fd);
+    if (rc < 0) {
+        perror("Failed to write input file");
+        unlink(file_name);
+        return -1;
+    }
+
+    printf("%-8s %8s %6s %8s %10s %10s\n", "mode", "sizing", "relay", "n", "seconds", "MB/s");
+    for (size_t k = 0; k < ns_count and !rc; k++) {
+        for (size_t m = 0; m < sizeof(modes) / sizeof(*modes) and !rc; m++) {
+            for (int adaptive = 0; adaptive <= (budget != NULL) and !rc; adaptive++) {
+                // Shm mode has no relay, so it runs once without the relay options
+                bool shm = !strcmp(modes[m], "shm");
+                for (int r = 0; r <= (epoll and !shm) and !rc; r++) {
+                    char* args[14] = { (char*) pipeline, "-m", (char*) modes[m] };
+                    size_t num_args = 3;
+                    if (!shm) {
+                        args[num_args++] = "-r";
+                        args[num_args++] = (char*) relays[r];
+                    }
+                    if (adaptive) {
+                        args[num_args++] = "-a";
+                        args[num_args++] = (char*) budget;
+                    }
+                    if (threads and !shm) {
+                        args[num_args++] = "-t";
+                        args[num_args++] = (char*) threads;
+                    }
+                    if (input and !shm) {
+                        args[num_args++] = "-i";
+                        args[num_args++] = (char*) input;
+                    }
+                    args[num_args++] = (char*) ns[k];
+                    args[num_args++] = file_name;
+                    struct timespec start, end;
+                    size_t size = 0;
+                    clock_gettime(CLOCK_MONOTONIC, &start);
+                    rc = runPipeline(args, &size);
+                    clock_gettime(CLOCK_MONOTONIC, &end);
+                    if (rc < 0 or size != size_mb << 20) {
+                        fprintf(stderr, "Pipeline %s with n %s failed\n", modes[m], ns[k]);
+                        rc = -1;
+                        break;
+                    }
+                    double d = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+                    printf("%-8s %8s %6s %8s %10.3f %10.1f\n",
+                        modes[m], adaptive ? "adaptive": "fixed", shm ? "-": relays[r], ns[k], d, size_mb / d
+                    );
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    unlink(file_name);
+    return rc;
+}
@@ -1,11 +1,27 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <iso646.h>
 #include <limits.h>
+#include <linux/futex.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef DEBUG
@@ -14,12 +30,48 @@
 #define DEBUG_PRINT(...)
 #endif
 
-int copyFile(int in, int out) {
-    enum {BUFFER_SIZE = 4096};
-    char buffer[BUFFER_SIZE] = {0};
+size_t minSize(size_t a, size_t b) {
+    return a < b ? a: b;
+}
+
+// The first child keeps the kernel reading this far ahead of it, well past
+// the default readahead, so large inputs stream from disk while it copies
+enum {READAHEAD_SIZE = 8 << 20};
+
+typedef struct {
+    int fd;
+    off_t offset;
+    off_t prefetched;
+} Prefetch;
+
+// Call with NULL for children that do not read the input
+void prefetchInput(Prefetch* prefetch, size_t num_moved) {
+    if (!prefetch) {
+        return;
+    }
+    prefetch->offset += num_moved;
+    if (prefetch->offset + READAHEAD_SIZE / 2 >= prefetch->prefetched) {
+        readahead(prefetch->fd, prefetch->prefetched, READAHEAD_SIZE);
+        prefetch->prefetched += READAHEAD_SIZE;
+    }
+}
+
+// With adaptive set the chunk size doubles whenever a read fills it
+int copyFile(int in, int out, bool adaptive, Prefetch* prefetch) {
+    enum {
+        BUFFER_SIZE = 4096,
+        MAX_BUFFER_SIZE = 1 << 18,
+    };
+    char* buffer = malloc(adaptive ? MAX_BUFFER_SIZE: BUFFER_SIZE);
+    if (!buffer) {
+        perror("Child: malloc failed");
+        return -1;
+    }
+    size_t size = BUFFER_SIZE;
     ssize_t num_read = 0;
+    prefetchInput(prefetch, 0);
     do {
-        num_read = read(in, buffer, BUFFER_SIZE);
+        num_read = read(in, buffer, size);
         DEBUG_PRINT("Child: read %zd from fd %d\n", num_read, in);
         ssize_t total_write = 0;
         while (total_write < num_read) {
@@ -27,13 +79,19 @@ int copyFile(int in, int out) {
             DEBUG_PRINT("Child: write %zd to fd %d\n", num_write, out);
             if (num_write < 0) {
                 perror("Child: write failed");
+                free(buffer);
                 return num_write;
             }
             total_write += num_write;
         }
         DEBUG_PRINT("Child: copy %zd from fd %d to fd %d\n", num_read, in, out);
+        prefetchInput(prefetch, total_write);
+        if (adaptive and (size_t) num_read == size and size < MAX_BUFFER_SIZE) {
+            size *= 2;
+        }
     }
     while (num_read > 0);
+    free(buffer);
     if (num_read < 0) {
         perror("Child: read failed");
         sleep(10);
@@ -41,13 +99,166 @@ int copyFile(int in, int out) {
     return num_read;
 }
 
-void runChild(int read_fd, int write_fd) {
-    int rc = copyFile(read_fd, write_fd);
+typedef enum {
+    MODE_COPY,
+    MODE_SPLICE,
+    // Neighbouring children share a ring in memory, there is no relay
+    MODE_SHM,
+} Mode;
+
+// Largest chunk a single splice call may move. Between pipes the kernel
+// moves at most what the source holds and the destination has room for
+enum {SPLICE_SIZE = 1 << 20};
+
+// Moves pages between the fds without copying them to user space.
+// Falls back to copyFile if the fds do not support splice,
+// for example when stdout is a terminal
+int spliceFile(int in, int out, Prefetch* prefetch) {
+    ssize_t num_spliced = 0;
+    prefetchInput(prefetch, 0);
+    do {
+        num_spliced = splice(in, NULL, out, NULL, SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        DEBUG_PRINT("Child: splice %zd from fd %d to fd %d\n", num_spliced, in, out);
+        if (num_spliced > 0) {
+            prefetchInput(prefetch, num_spliced);
+        }
+    }
+    while (num_spliced > 0);
+    if (num_spliced < 0) {
+        if (errno == EINVAL) {
+            DEBUG_PRINT("Child: splice is not supported, copy from fd %d to fd %d\n", in, out);
+            return copyFile(in, out, false, prefetch);
+        }
+        perror("Child: splice failed");
+    }
+    return num_spliced;
+}
+
+// Like spliceFile, but also works when out is not a pipe
+int sendFile(int in, int out, Prefetch* prefetch) {
+    ssize_t num_sent = 0;
+    prefetchInput(prefetch, 0);
+    do {
+        num_sent = sendfile(out, in, NULL, SPLICE_SIZE);
+        DEBUG_PRINT("Child: sendfile %zd from fd %d to fd %d\n", num_sent, in, out);
+        if (num_sent > 0) {
+            prefetchInput(prefetch, num_sent);
+        }
+    }
+    while (num_sent > 0);
+    if (num_sent < 0) {
+        if (errno == EINVAL) {
+            DEBUG_PRINT("Child: sendfile is not supported, copy from fd %d to fd %d\n", in, out);
+            return copyFile(in, out, false, prefetch);
+        }
+        perror("Child: sendfile failed");
+    }
+    return num_sent;
+}
+
+// Writes straight from the page cache through a read only mapping of the
+// input, so the only copy is the one into the pipe. Inputs that cannot be
+// mapped, like empty files or pipes, are copied
+int mmapFile(int in, int out) {
+    enum {CHUNK_SIZE = 1 << 20};
+    struct stat st;
+    if (fstat(in, &st) < 0 or !S_ISREG(st.st_mode) or !st.st_size) {
+        return copyFile(in, out, false, NULL);
+    }
+    size_t size = st.st_size;
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+    if (data == MAP_FAILED) {
+        DEBUG_PRINT("Child: mmap failed, copy from fd %d to fd %d\n", in, out);
+        return copyFile(in, out, false, NULL);
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    size_t offset = 0;
+    size_t prefetched = 0;
+    while (offset < size) {
+        if (prefetched < size and offset + READAHEAD_SIZE / 2 >= prefetched) {
+            madvise(data + prefetched, minSize(READAHEAD_SIZE, size - prefetched), MADV_WILLNEED);
+            prefetched += READAHEAD_SIZE;
+        }
+        ssize_t num_write = write(out, data + offset, minSize(CHUNK_SIZE, size - offset));
+        DEBUG_PRINT("Child: write %zd from the mapping to fd %d\n", num_write, out);
+        if (num_write < 0) {
+            perror("Child: write failed");
+            munmap(data, size);
+            return -1;
+        }
+        offset += num_write;
+    }
+    munmap(data, size);
+    return 0;
+}
+
+typedef enum {
+    // Whatever the mode uses between pipes
+    INPUT_DEFAULT,
+    INPUT_READ,
+    INPUT_MMAP,
+    INPUT_SENDFILE,
+    INPUT_SPLICE,
+} Input;
+
+void runChild(int read_fd, int write_fd, Mode mode, bool adaptive) {
+    int rc = mode == MODE_SPLICE ? spliceFile(read_fd, write_fd, NULL): copyFile(read_fd, write_fd, adaptive, NULL);
     DEBUG_PRINT("Child: close fds %d and %d\n", read_fd, write_fd);
     exit(rc);
 }
 
-int spawnChildren(unsigned n, int file_fd, int** write_fds_ptr, int** read_fds_ptr) {
+// Runs the first child, which reads the input file instead of a pipe
+void runInputChild(int file_fd, int write_fd, Mode mode, Input input, bool adaptive) {
+    posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    Prefetch prefetch = {
+        .fd = file_fd,
+    };
+    if (input == INPUT_DEFAULT) {
+        input = mode == MODE_SPLICE ? INPUT_SPLICE: INPUT_READ;
+    }
+    int rc = 0;
+    switch (input) {
+    case INPUT_MMAP:
+        rc = mmapFile(file_fd, write_fd);
+        break;
+    case INPUT_SENDFILE:
+        rc = sendFile(file_fd, write_fd, &prefetch);
+        break;
+    case INPUT_SPLICE:
+        rc = spliceFile(file_fd, write_fd, &prefetch);
+        break;
+    default:
+        rc = copyFile(file_fd, write_fd, adaptive, &prefetch);
+        break;
+    }
+    DEBUG_PRINT("Child: close fds %d and %d\n", file_fd, write_fd);
+    exit(rc);
+}
+
+// Closes every fd a child inherited from the parent except its own two,
+// in a few syscalls however many pipes the parent holds
+int closeOtherFds(int read_fd, int write_fd) {
+    int keep[] = {
+        read_fd < write_fd ? read_fd: write_fd,
+        read_fd < write_fd ? write_fd: read_fd,
+    };
+    unsigned first = STDERR_FILENO + 1;
+    for (unsigned k = 0; k < sizeof(keep) / sizeof(*keep); k++) {
+        if (keep[k] < (int) first) {
+            continue;
+        }
+        if (keep[k] > (int) first and close_range(first, keep[k] - 1, 0) < 0) {
+            return -1;
+        }
+        first = keep[k] + 1;
+    }
+    return close_range(first, ~0U, 0);
+}
+
+// A non-zero pipe_size sets the capacity of every pipe, and makes the
+// children adapt their chunk size
+int spawnChildren(unsigned n, int file_fd, Mode mode, Input input, size_t pipe_size, int** write_fds_ptr, int** read_fds_ptr) {
     enum {
         READ_END = 0,
         WRITE_END = 1,
@@ -69,6 +280,10 @@ int spawnChildren(unsigned n, int file_fd, int** write_fds_ptr, int** read_fds_p
                 perror("Failed to create to child pipe");
                 return -1;
             }
+            if (pipe_size and fcntl(to_child_fildes[WRITE_END], F_SETPIPE_SZ, pipe_size) < 0) {
+                perror("Failed to resize to child pipe");
+                return -1;
+            }
             DEBUG_PRINT("Open to pipe for child %u with READ_END %d and WRITE_END %d\n",
                 i, to_child_fildes[READ_END], to_child_fildes[WRITE_END]
             );
@@ -78,6 +293,10 @@ int spawnChildren(unsigned n, int file_fd, int** write_fds_ptr, int** read_fds_p
                 perror("Failed from create from child pipe");
                 return -1;
             }
+            if (pipe_size and fcntl(from_child_fildes[WRITE_END], F_SETPIPE_SZ, pipe_size) < 0) {
+                perror("Failed to resize from child pipe");
+                return -1;
+            }
             DEBUG_PRINT("Open from pipe for child %u with READ_END %d and WRITE_END %d\n",
                 i, from_child_fildes[READ_END], from_child_fildes[WRITE_END]
             );
@@ -89,41 +308,18 @@ int spawnChildren(unsigned n, int file_fd, int** write_fds_ptr, int** read_fds_p
             return -1;
         }
         if (!pid) {
-            for (unsigned j = 0; j < i; j++) {
-                if (close(read_fds[j]) < 0) {
-                    perror("Pipe fd close failed");
-                    return -1;
-                }
-            }
-            for (unsigned j = 1; j < i; j++) {
-                if (close(write_fds[j - 1]) < 0) {
-                    perror("Pipe fd close failed");
-                    return -1;
-                }
-            }
             free(write_fds);
             free(read_fds);
-            int read_fd = to_child_fildes[READ_END];
-            int write_fd = from_child_fildes[WRITE_END];
-            if (i == 0) {
-                read_fd = file_fd;
-            }
-            else {
-                if (close(to_child_fildes[WRITE_END]) < 0) {
-                    perror("Pipe fd close failed");
-                    return -1;
-                }
-            }
-            if (i == n - 1) {
-                write_fd = STDOUT_FILENO;
+            int read_fd = i == 0 ? file_fd: to_child_fildes[READ_END];
+            int write_fd = i == n - 1 ? STDOUT_FILENO: from_child_fildes[WRITE_END];
+            if (closeOtherFds(read_fd, write_fd) < 0) {
+                perror("Pipe fd close failed");
+                return -1;
             }
-            else {
-                if (close(from_child_fildes[READ_END]) < 0) {
-                    perror("Pipe fd close failed");
-                    return -1;
-                }
+            if (i == 0) {
+                runInputChild(read_fd, write_fd, mode, input, pipe_size > 0);
             }
-            runChild(read_fd, write_fd);
+            runChild(read_fd, write_fd, mode, pipe_size > 0);
         }
         else {
             DEBUG_PRINT("Spawn child %d\n", pid);
@@ -210,143 +406,1263 @@ int allocateBuffers(unsigned n, char*** buffers_ptr, size_t** sizes_ptr, char**
     return 0;
 }
 
-int main(int argc, const char* argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s n file\n", argv[0]);
-        return -1;
+// Totals since the relay started. Only the stage's relay thread writes
+// them, the stats dumper reads them while the relay runs
+typedef struct {
+    uint64_t bytes;
+    // Calls issued, a splice counts as both a read and a write
+    uint64_t reads;
+    uint64_t writes;
+    // Time spent with nothing to write waiting for child i,
+    // and with data waiting for child i + 1 to make room
+    uint64_t read_wait_ns;
+    uint64_t write_wait_ns;
+    // Most bytes held in the ring, or queued in child i's pipe
+    // when a splice found child i + 1's pipe full
+    uint64_t peak_buffered;
+} StageStats;
+
+void addCounter(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+void raiseCounter(uint64_t* counter, uint64_t value) {
+    if (value > __atomic_load_n(counter, __ATOMIC_RELAXED)) {
+        __atomic_store_n(counter, value, __ATOMIC_RELAXED);
     }
-    char* end = NULL;
-    long long n = strtoll(argv[1], &end, 10);
-    if (*end or n <= 0) {
-        fprintf(stderr, "N must be an non-negative integer\n");
-        return -1;
+}
+
+uint64_t readCounter(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+typedef enum {
+    WAIT_NONE,
+    WAIT_READ,
+    WAIT_WRITE,
+} Wait;
+
+typedef struct {
+    // Pipe from child i and pipe to child i + 1
+    int read_fd;
+    int write_fd;
+    // Copy mode ring buffer holding num_available bytes from head on,
+    // its capacity is also the most a single splice may move
+    char* buffer;
+    size_t capacity;
+    size_t head;
+    size_t num_available;
+    // Child i has closed its pipe, the stage finishes once the ring is empty
+    bool eof;
+    bool finished;
+    // Edge triggered readiness, cleared when a call would block
+    bool readable;
+    bool writable;
+
+    // Bytes in child i's pipe when the last splice would block
+    size_t queued;
+
+    // Flow since the capacity was last adjusted
+    size_t reads;
+    size_t full_reads;
+    size_t stalls;
+    size_t bytes;
+
+    Wait wait;
+    uint64_t wait_since_ns;
+    StageStats stats;
+} Stage;
+
+// Describes the free space of the ring, which wraps around its end
+int ringFree(const Stage* stage, struct iovec* iov) {
+    size_t tail = (stage->head + stage->num_available) % stage->capacity;
+    size_t free_size = stage->capacity - stage->num_available;
+    iov[0] = (struct iovec) { stage->buffer + tail, minSize(free_size, stage->capacity - tail) };
+    iov[1] = (struct iovec) { stage->buffer, free_size - iov[0].iov_len };
+    return iov[1].iov_len ? 2: 1;
+}
+
+// Describes the bytes in the ring in the order they were read
+int ringData(const Stage* stage, struct iovec* iov) {
+    iov[0] = (struct iovec) {
+        stage->buffer + stage->head, minSize(stage->num_available, stage->capacity - stage->head)
+    };
+    iov[1] = (struct iovec) { stage->buffer, stage->num_available - iov[0].iov_len };
+    return iov[1].iov_len ? 2: 1;
+}
+
+// Reads from child i into the free space of the ring
+ssize_t fillRing(Stage* stage) {
+    struct iovec iov[2];
+    int iov_cnt = ringFree(stage, iov);
+    size_t free_size = stage->capacity - stage->num_available;
+    ssize_t num_read = readv(stage->read_fd, iov, iov_cnt);
+    DEBUG_PRINT("Read %zd of %zu from fd %d\n", num_read, free_size, stage->read_fd);
+    addCounter(&stage->stats.reads, 1);
+    if (num_read == 0) {
+        stage->eof = true;
     }
-    if (errno == ERANGE or n > UINT_MAX) {
-        fprintf(stderr, "N is too large. Use a smaller value\n");
+    else if (num_read > 0) {
+        stage->num_available += num_read;
+        raiseCounter(&stage->stats.peak_buffered, stage->num_available);
+        stage->reads++;
+        stage->full_reads += (size_t) num_read == free_size;
+        stage->bytes += num_read;
+    }
+    return num_read;
+}
+
+// Writes the ring's data to child i + 1
+ssize_t drainRing(Stage* stage) {
+    struct iovec iov[2];
+    int iov_cnt = ringData(stage, iov);
+    ssize_t num_written = writev(stage->write_fd, iov, iov_cnt);
+    DEBUG_PRINT("Write %zd of %zu to fd %d\n", num_written, stage->num_available, stage->write_fd);
+    addCounter(&stage->stats.writes, 1);
+    if (num_written > 0) {
+        addCounter(&stage->stats.bytes, num_written);
+        stage->stalls += (size_t) num_written < stage->num_available;
+        stage->num_available -= num_written;
+        stage->head = stage->num_available ? (stage->head + num_written) % stage->capacity: 0;
+    }
+    return num_written;
+}
+
+// Moves what child i has written to child i + 1 without leaving the kernel
+ssize_t spliceStage(Stage* stage) {
+    ssize_t num_spliced = splice(
+        stage->read_fd, NULL, stage->write_fd, NULL, stage->capacity, SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+    );
+    DEBUG_PRINT("Splice %zd from fd %d to fd %d\n", num_spliced, stage->read_fd, stage->write_fd);
+    addCounter(&stage->stats.reads, 1);
+    addCounter(&stage->stats.writes, 1);
+    if (num_spliced == 0) {
+        stage->eof = true;
+    }
+    else if (num_spliced > 0) {
+        stage->queued = 0;
+        stage->reads++;
+        stage->full_reads += (size_t) num_spliced == stage->capacity;
+        stage->bytes += num_spliced;
+        addCounter(&stage->stats.bytes, num_spliced);
+    }
+    else if (errno == EAGAIN) {
+        // Whether child i's pipe is empty or child i + 1's is full
+        int queued = 0;
+        ioctl(stage->read_fd, FIONREAD, &queued);
+        stage->queued = queued;
+        raiseCounter(&stage->stats.peak_buffered, queued);
+        stage->stalls++;
+        errno = EAGAIN;
+    }
+    return num_spliced;
+}
+
+// Moves what child i has written to child i + 1 through the stage's ring.
+// The read fd is polled while the ring has room and the write fd while it
+// holds data, so a slow child i + 1 does not stop reads from child i.
+// Reads pause while the ring is more than half full
+int relayCopy(Stage* stage, struct pollfd* read_fd, struct pollfd* write_fd, bool* can_finish) {
+    bool can_read = read_fd->fd > 0 and read_fd->revents & (POLLIN | POLLHUP);
+    bool can_write = write_fd->fd > 0 and write_fd->revents & POLLOUT;
+    if (write_fd->fd > 0 and write_fd->revents & POLLERR) {
+        *can_finish = true;
+        return 0;
+    }
+    if (can_read and fillRing(stage) < 0) {
+        perror("Read failed");
         return -1;
     }
-    const char* file_name = argv[2];
-    int file_fd = open(file_name, O_RDONLY);
-    if (file_fd < 0) {
-        perror("Failed to open file");
+    if (can_write and stage->num_available and drainRing(stage) < 0) {
+        perror("Write failed");
         return -1;
     }
 
-    int* write_fds = NULL;
-    int* read_fds = NULL;
-    DEBUG_PRINT("Spawn children\n");
-    if (spawnChildren(n, file_fd, &write_fds, &read_fds) < 0) {
-        fprintf(stderr, "Failed to spawn all children\n");
-        return -1;
+    // Reading into every sliver of free space would cost a syscall per few bytes
+    bool can_poll_read = !stage->eof and stage->num_available <= stage->capacity / 2;
+    read_fd->fd = can_poll_read ? stage->read_fd: -stage->read_fd;
+    write_fd->fd = stage->num_available ? stage->write_fd: -stage->write_fd;
+    *can_finish = stage->eof and !stage->num_available;
+    return 0;
+}
+
+// The read fd is polled until a splice finds child i + 1's pipe full,
+// then the write fd is polled until that pipe has room again
+int relaySplice(Stage* stage, struct pollfd* read_fd, struct pollfd* write_fd, bool* can_finish) {
+    if (read_fd->fd > 0 and read_fd->revents & (POLLIN | POLLHUP)) {
+        ssize_t num_spliced = spliceStage(stage);
+        if (num_spliced == 0) {
+            *can_finish = true;
+        }
+        else if (num_spliced < 0) {
+            if (errno != EAGAIN) {
+                perror("Splice failed");
+                return -1;
+            }
+            read_fd->fd *= -1;
+            write_fd->fd *= -1;
+        }
     }
+    else if (write_fd->fd > 0 and write_fd->revents & POLLOUT) {
+        read_fd->fd *= -1;
+        write_fd->fd *= -1;
+    }
+    else if (write_fd->fd > 0 and write_fd->revents & POLLERR) {
+        *can_finish = true;
+    }
+    return 0;
+}
 
-    size_t num_buffers = n - 1;
-    if (!num_buffers) {
-        return 0;
+// Reads and writes until both sides of the stage would block, which
+// edge triggered readiness requires before waiting again
+int pumpCopy(Stage* stage, bool* can_finish) {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        if (stage->readable and !stage->eof and stage->num_available < stage->capacity) {
+            if (fillRing(stage) >= 0) {
+                progress = true;
+            }
+            else if (errno == EAGAIN) {
+                stage->readable = false;
+            }
+            else {
+                perror("Read failed");
+                return -1;
+            }
+        }
+        if (stage->writable and stage->num_available) {
+            size_t num_available = stage->num_available;
+            ssize_t num_written = drainRing(stage);
+            if (num_written >= 0) {
+                progress = true;
+                // A short write means child i + 1's pipe is full
+                stage->writable = (size_t) num_written == num_available;
+            }
+            else if (errno == EAGAIN) {
+                stage->writable = false;
+            }
+            else {
+                perror("Write failed");
+                return -1;
+            }
+        }
     }
-    char** buffers = NULL;
-    size_t* buffer_sizes = NULL;
-    char* allocation = NULL;
-    DEBUG_PRINT("Allocate buffers\n");
-    if (allocateBuffers(n, &buffers, &buffer_sizes, &allocation) < 0) {
-        fprintf(stderr, "Malloc failed\n");
+    *can_finish = stage->eof and !stage->num_available;
+    return 0;
+}
+
+// A failed splice does not tell which pipe would block, but whichever it
+// was raises an edge once it can move, so every event retries
+int pumpSplice(Stage* stage, bool* can_finish) {
+    ssize_t num_spliced = 1;
+    while (num_spliced > 0) {
+        num_spliced = spliceStage(stage);
+    }
+    if (num_spliced < 0 and errno != EAGAIN) {
+        perror("Splice failed");
         return -1;
     }
+    *can_finish = stage->eof;
+    return 0;
+}
 
-    size_t* num_available = calloc(num_buffers, sizeof(*num_available));
-    if (!num_available) {
-        fprintf(stderr, "Malloc failed\n");
+// Adaptive sizing gives every stage one capacity: the size of its buffer
+// and of both pipes it relays between. Stages whose reads keep filling
+// their capacity double it while the memory budget allows, stages whose
+// reads stay small give half of it back
+enum {
+    MIN_CAPACITY = 1 << 12,
+    INITIAL_CAPACITY = 1 << 16,
+    ADAPT_PERIOD_MS = 50,
+};
+
+typedef struct {
+    Mode mode;
+    // Zero when sizing is fixed
+    size_t budget;
+    size_t used;
+    // Pipes a capacity above this need CAP_SYS_RESOURCE
+    size_t max_capacity;
+    struct timespec last_adapt;
+} Sizing;
+
+size_t maxPipeSize() {
+    size_t size = 1 << 20;
+    FILE* f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (f) {
+        if (fscanf(f, "%zu", &size) != 1) {
+            size = 1 << 20;
+        }
+        fclose(f);
+    }
+    return size;
+}
+
+size_t stageMemory(Mode mode, size_t capacity) {
+    return (mode == MODE_COPY ? 3 : 2) * capacity;
+}
+
+int resizeStage(Stage* stage, Mode mode, size_t capacity) {
+    if (fcntl(stage->read_fd, F_SETPIPE_SZ, capacity) < 0) {
         return -1;
     }
-    char** offset_buffers = calloc(num_buffers, sizeof(*offset_buffers));
-    if (!num_available) {
-        fprintf(stderr, "Malloc failed\n");
+    if (fcntl(stage->write_fd, F_SETPIPE_SZ, capacity) < 0) {
+        fcntl(stage->read_fd, F_SETPIPE_SZ, stage->capacity);
         return -1;
     }
+    if (mode == MODE_COPY) {
+        char* buffer = malloc(capacity);
+        if (!buffer) {
+            fcntl(stage->read_fd, F_SETPIPE_SZ, stage->capacity);
+            fcntl(stage->write_fd, F_SETPIPE_SZ, stage->capacity);
+            return -1;
+        }
+        if (stage->buffer) {
+            struct iovec iov[2];
+            ringData(stage, iov);
+            memcpy(buffer, iov[0].iov_base, iov[0].iov_len);
+            memcpy(buffer + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+            free(stage->buffer);
+        }
+        stage->buffer = buffer;
+        stage->head = 0;
+    }
+    DEBUG_PRINT("Resize stage from %zu to %zu\n", stage->capacity, capacity);
+    stage->capacity = capacity;
+    return 0;
+}
+
+// A ring only shrinks if its data fits the smaller capacity
+void adaptStages(Stage* stages, size_t num_stages, Sizing* sizing) {
+    Mode mode = sizing->mode;
+    for (int grow = 0; grow < 2; grow++) {
+        for (size_t i = 0; i < num_stages; i++) {
+            Stage* stage = &stages[i];
+            if (stage->finished or !stage->reads) {
+                continue;
+            }
+            size_t capacity = stage->capacity;
+            bool filled = 2 * stage->full_reads > stage->reads;
+            bool stalled = 2 * stage->stalls > stage->reads;
+            bool small = stage->bytes / stage->reads < capacity / 4;
+            if (grow and filled and !stalled and 2 * capacity <= sizing->max_capacity and
+                sizing->used + stageMemory(mode, capacity) <= sizing->budget and
+                !resizeStage(stage, mode, 2 * capacity)
+            ) {
+                sizing->used += stageMemory(mode, capacity);
+            }
+            if (!grow and small and capacity / 2 >= MIN_CAPACITY and stage->num_available <= capacity / 2 and
+                !resizeStage(stage, mode, capacity / 2)
+            ) {
+                sizing->used -= stageMemory(mode, capacity / 2);
+            }
+        }
+    }
+    for (size_t i = 0; i < num_stages; i++) {
+        stages[i].reads = 0;
+        stages[i].full_reads = 0;
+        stages[i].stalls = 0;
+        stages[i].bytes = 0;
+    }
+}
+
+// Every stage starts with the same capacity, the largest power of two
+// up to the default pipe size that keeps all stages within the budget
+size_t initialCapacity(size_t num_stages, Mode mode, size_t budget) {
+    size_t capacity = INITIAL_CAPACITY;
+    while (capacity > MIN_CAPACITY and num_stages * stageMemory(mode, capacity) > budget) {
+        capacity /= 2;
+    }
+    if (num_stages * stageMemory(mode, capacity) > budget) {
+        fprintf(stderr, "Memory budget is too small, use %zu bytes per stage\n", stageMemory(mode, capacity));
+    }
+    return capacity;
+}
+
+long long elapsedMs(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000ll + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Resizes the stages once per adapt period, however often the relay wakes up
+void maybeAdaptStages(Stage* stages, size_t num_stages, Sizing* sizing) {
+    if (sizing->budget and elapsedMs(&sizing->last_adapt) >= ADAPT_PERIOD_MS) {
+        adaptStages(stages, num_stages, sizing);
+        clock_gettime(CLOCK_MONOTONIC, &sizing->last_adapt);
+    }
+}
+
+uint64_t nowNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Charges the time since the stage's last relay call to what it waited
+// on, a stage holding data waits on child i + 1 and an empty one on child i
+void updateWait(Stage* stage, Mode mode, uint64_t now_ns) {
+    Wait wait = WAIT_NONE;
+    if (!stage->finished) {
+        bool holds_data = mode == MODE_SPLICE ? stage->queued > 0: stage->num_available > 0;
+        wait = holds_data ? WAIT_WRITE: WAIT_READ;
+    }
+    if (wait == stage->wait) {
+        return;
+    }
+    if (stage->wait == WAIT_READ) {
+        addCounter(&stage->stats.read_wait_ns, now_ns - stage->wait_since_ns);
+    }
+    else if (stage->wait == WAIT_WRITE) {
+        addCounter(&stage->stats.write_wait_ns, now_ns - stage->wait_since_ns);
+    }
+    stage->wait = wait;
+    stage->wait_since_ns = now_ns;
+}
+
+typedef enum {
+    STATS_NONE,
+    STATS_TABLE,
+    STATS_JSON,
+} StatsFormat;
+
+void dumpStats(const Stage* stages, size_t num_stages, StatsFormat format, FILE* out) {
+    if (format == STATS_JSON) {
+        fprintf(out, "{\"stages\": [");
+    }
+    else {
+        fprintf(out, "%6s %14s %10s %10s %10s %12s %12s %14s\n",
+            "stage", "bytes", "reads", "writes", "avg_chunk", "read_wait_s", "write_wait_s", "peak_buffered"
+        );
+    }
+    for (size_t i = 0; i < num_stages; i++) {
+        const StageStats* stats = &stages[i].stats;
+        uint64_t bytes = readCounter(&stats->bytes);
+        uint64_t reads = readCounter(&stats->reads);
+        uint64_t writes = readCounter(&stats->writes);
+        double avg_chunk = writes ? (double) bytes / writes: 0.0;
+        double read_wait_s = readCounter(&stats->read_wait_ns) / 1e9;
+        double write_wait_s = readCounter(&stats->write_wait_ns) / 1e9;
+        uint64_t peak_buffered = readCounter(&stats->peak_buffered);
+        if (format == STATS_JSON) {
+            fprintf(out,
+                "%s\n  {\"stage\": %zu, \"bytes\": %" PRIu64 ", \"reads\": %" PRIu64 ", \"writes\": %" PRIu64
+                ", \"avg_chunk\": %.1f, \"read_wait_s\": %.6f, \"write_wait_s\": %.6f, \"peak_buffered\": %" PRIu64 "}",
+                i ? ",": "", i, bytes, reads, writes, avg_chunk, read_wait_s, write_wait_s, peak_buffered
+            );
+        }
+        else {
+            fprintf(out, "%6zu %14" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10.1f %12.3f %12.3f %14" PRIu64 "\n",
+                i, bytes, reads, writes, avg_chunk, read_wait_s, write_wait_s, peak_buffered
+            );
+        }
+    }
+    if (format == STATS_JSON) {
+        fprintf(out, "\n]}\n");
+    }
+    fflush(out);
+}
+
+typedef struct {
+    const Stage* stages;
+    size_t num_stages;
+    StatsFormat format;
+} StatsDumper;
+
+// Dumps the stats on every SIGUSR1, which every other thread blocks
+void* runStatsDumper(void* arg) {
+    const StatsDumper* dumper = arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    int sig;
+    while (!sigwait(&set, &sig)) {
+        dumpStats(dumper->stages, dumper->num_stages, dumper->format, stderr);
+    }
+    return NULL;
+}
+
+void finishStage(Stage* stage) {
+    DEBUG_PRINT("Close fds %d and %d\n", stage->read_fd, stage->write_fd);
+    close(stage->read_fd);
+    close(stage->write_fd);
+    stage->finished = true;
+}
 
+// Polls all 2 * (n - 1) fds and visits every stage on each wakeup.
+// Returns once every stage has finished
+int runPollRelay(Stage* stages, size_t num_stages, Sizing* sizing) {
     DEBUG_PRINT("Setup poll structures\n");
-    size_t num_fds = 2 * num_buffers;
+    size_t num_fds = 2 * num_stages;
     struct pollfd* fds = calloc(num_fds, sizeof(*fds));
-    for (unsigned i = 0; i < num_buffers; i++) {
+    if (!fds) {
+        fprintf(stderr, "Malloc failed\n");
+        return -1;
+    }
+    for (unsigned i = 0; i < num_stages; i++) {
         struct pollfd* read_fd = &fds[2 * i];
         struct pollfd* write_fd = &fds[2 * i + 1];
-        read_fd->fd = read_fds[i];
+        read_fd->fd = stages[i].read_fd;
         read_fd->events = POLLIN;
-        write_fd->fd = -write_fds[i];
+        write_fd->fd = -stages[i].write_fd;
         write_fd->events = POLLOUT;
     }
+    size_t num_finished = 0;
     while(true) {
         DEBUG_PRINT("Poll\n");
-        if (poll(fds, num_fds, -1) < 0) {
+        if (poll(fds, num_fds, sizing->budget ? ADAPT_PERIOD_MS: -1) < 0) {
             return -1;
         }
+        uint64_t now_ns = nowNs();
+        maybeAdaptStages(stages, num_stages, sizing);
 
-        for (unsigned i = 0; i < num_buffers; i++) {
+        for (unsigned i = 0; i < num_stages; i++) {
             DEBUG_PRINT("Process buffer %u\n", i);
 
+            Stage* stage = &stages[i];
+            if (stage->finished) {
+                continue;
+            }
             struct pollfd* read_fd = &fds[2 * i];
             struct pollfd* write_fd = &fds[2 * i + 1];
             DEBUG_PRINT("Read fd: %d; Write fd: %d\n", read_fd->fd, write_fd->fd);
-            DEBUG_PRINT("Num available: %zu\n", num_available[i]);
+            DEBUG_PRINT("Num available: %zu\n", stage->num_available);
             DEBUG_PRINT("POLLIN: %d\n", read_fd->revents & POLLIN);
             DEBUG_PRINT("POLLHUP: %d\n", read_fd->revents & POLLHUP);
             DEBUG_PRINT("POLLOUT: %d\n", write_fd->revents & POLLOUT);
             DEBUG_PRINT("POLLERR: %d\n", write_fd->revents & POLLERR);
-            bool can_read = read_fd->fd > 0 and read_fd->revents & POLLIN;
-            bool can_write = write_fd->fd > 0 and write_fd->revents & POLLOUT;
-            bool can_finish =
-                (read_fd->fd > 0 and read_fd->revents & POLLHUP and !can_read) or
-                (write_fd->fd > 0 and write_fd->revents & POLLERR);
-            if (!num_available[i] and can_read) {
-                DEBUG_PRINT("Child %u can write\n", i);
-                ssize_t num_read = read(read_fd->fd, buffers[i], buffer_sizes[i]);
-                DEBUG_PRINT("Child %u wrote %zd to fd %d\n", i, num_read, read_fd->fd);
-                if (num_read <= 0) {
-                    can_finish = true;
-                    if (num_read < 0) {
-                        perror("Read failed");
-                        return -1;
-                    }
-                }
-                else {
-                    num_available[i] = num_read;
-                    offset_buffers[i] = buffers[i];
+            bool can_finish = false;
+            int rc = sizing->mode == MODE_SPLICE ?
+                relaySplice(stage, read_fd, write_fd, &can_finish):
+                relayCopy(stage, read_fd, write_fd, &can_finish);
+            if (rc < 0) {
+                return -1;
+            }
 
-                    read_fd->fd *= -1;
-                    write_fd->fd *= -1;
-                }
+            if (can_finish) {
+                finishStage(stage);
+                read_fd->fd = -1;
+                write_fd->fd = -1;
             }
-            if (num_available[i] and can_write) {
-                DEBUG_PRINT("Child %u can read\n", i + 1);
-                ssize_t num_written = write(write_fd->fd, offset_buffers[i], num_available[i]);
-                DEBUG_PRINT("Child %u read %zd from fd %d\n", i + 1, num_written, write_fd->fd);
-                if (num_written <= 0) {
-                    can_finish = true;
-                    if (num_written < 0) {
-                        perror("Write failed");
-                        return -1;
-                    }
+            updateWait(stage, sizing->mode, now_ns);
+            if (can_finish) {
+                if (++num_finished == num_stages) {
+                    free(fds);
+                    return 0;
                 }
-                else {
-                    num_available[i] -= num_written;
+            }
+        }
+    }
+}
+
+// Registers both fds of every stage once, edge triggered, so each wakeup
+// only costs the stages that have events whatever the chain length.
+// The low bit of an event's data tells the write fd from the read fd
+int runEpollRelay(Stage* stages, size_t num_stages, Sizing* sizing) {
+    enum {MAX_EVENTS = 256};
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("Failed to create epoll instance");
+        return -1;
+    }
+    for (size_t i = 0; i < num_stages; i++) {
+        struct epoll_event read_event = {
+            .events = EPOLLIN | EPOLLET,
+            .data.u64 = 2 * i,
+        };
+        struct epoll_event write_event = {
+            .events = EPOLLOUT | EPOLLET,
+            .data.u64 = 2 * i + 1,
+        };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stages[i].read_fd, &read_event) < 0 or
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stages[i].write_fd, &write_event) < 0
+        ) {
+            perror("Failed to add stage to epoll");
+            close(epoll_fd);
+            return -1;
+        }
+    }
 
-                    if (!num_available[i]) {
-                        read_fd->fd *= -1;
-                        write_fd->fd *= -1;
-                    }
+    struct epoll_event events[MAX_EVENTS];
+    size_t num_finished = 0;
+    while (true) {
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, sizing->budget ? ADAPT_PERIOD_MS: -1);
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Epoll wait failed");
+            close(epoll_fd);
+            return -1;
+        }
+        uint64_t now_ns = nowNs();
+        maybeAdaptStages(stages, num_stages, sizing);
+
+        for (int k = 0; k < num_events; k++) {
+            size_t i = events[k].data.u64 / 2;
+            bool is_write = events[k].data.u64 % 2;
+            Stage* stage = &stages[i];
+            if (stage->finished) {
+                continue;
+            }
+            DEBUG_PRINT("Stage %zu %s events %x\n", i, is_write ? "write": "read", events[k].events);
+
+            bool can_finish = false;
+            if (is_write and events[k].events & EPOLLERR) {
+                can_finish = true;
+            }
+            else {
+                stage->readable |= !is_write;
+                stage->writable |= is_write;
+                int rc = sizing->mode == MODE_SPLICE ?
+                    pumpSplice(stage, &can_finish):
+                    pumpCopy(stage, &can_finish);
+                if (rc < 0) {
+                    close(epoll_fd);
+                    return -1;
                 }
             }
 
             if (can_finish) {
-                read_fd->fd = abs(read_fd->fd);
-                write_fd->fd = abs(write_fd->fd);
-                DEBUG_PRINT("Close fds %d and %d\n", read_fd->fd, write_fd->fd);
-                close(read_fd->fd);
-                close(write_fd->fd);
-                if (i == num_buffers - 1) {
+                finishStage(stage);
+            }
+            updateWait(stage, sizing->mode, now_ns);
+            if (can_finish) {
+                if (++num_finished == num_stages) {
+                    close(epoll_fd);
                     return 0;
                 }
             }
         }
     }
 }
+
+typedef enum {
+    RELAY_POLL,
+    RELAY_EPOLL,
+} Relay;
+
+typedef struct {
+    int cpu;
+    int core;
+    int package;
+    // Number of allowed CPUs before this one on the same core
+    int sibling;
+} CPU;
+
+int readTopologyId(int cpu, const char* name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    int id = -1;
+    FILE* f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%d", &id) != 1) {
+            id = -1;
+        }
+        fclose(f);
+    }
+    return id;
+}
+
+int compareCPUs(const void* a, const void* b) {
+    const CPU* x = a;
+    const CPU* y = b;
+    if (x->sibling != y->sibling) {
+        return x->sibling - y->sibling;
+    }
+    if (x->package != y->package) {
+        return x->package - y->package;
+    }
+    return x->cpu - y->cpu;
+}
+
+// Lists the CPUs this process may run on, one per core before any core's
+// second hardware thread. Returns the number of CPUs and stores the
+// number of cores in num_cores_ptr
+int orderedCPUs(CPU** cpus_ptr, int* num_cores_ptr) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        return -1;
+    }
+    CPU* cpus = calloc(CPU_COUNT(&set), sizeof(*cpus));
+    if (!cpus) {
+        return -1;
+    }
+    int num_cpus = 0;
+    int num_cores = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) {
+            continue;
+        }
+        CPU* c = &cpus[num_cpus];
+        c->cpu = cpu;
+        c->core = readTopologyId(cpu, "core_id");
+        c->package = readTopologyId(cpu, "physical_package_id");
+        for (int j = 0; j < num_cpus; j++) {
+            c->sibling += c->core >= 0 and cpus[j].core == c->core and cpus[j].package == c->package;
+        }
+        num_cores += !c->sibling;
+        num_cpus++;
+    }
+    qsort(cpus, num_cpus, sizeof(*cpus), compareCPUs);
+    *cpus_ptr = cpus;
+    *num_cores_ptr = num_cores;
+    return num_cpus;
+}
+
+// Each thread owns a contiguous run of stages with its own event loop and
+// its share of the memory budget, so threads share nothing on the data path
+typedef struct {
+    pthread_t thread;
+    Stage* stages;
+    size_t num_stages;
+    Relay relay;
+    Sizing sizing;
+    int rc;
+} RelayThread;
+
+void* runRelayThread(void* arg) {
+    RelayThread* t = arg;
+    t->rc = t->relay == RELAY_EPOLL ?
+        runEpollRelay(t->stages, t->num_stages, &t->sizing):
+        runPollRelay(t->stages, t->num_stages, &t->sizing);
+    if (t->rc < 0) {
+        // Let the neighbouring children see their pipes close
+        for (size_t i = 0; i < t->num_stages; i++) {
+            if (!t->stages[i].finished) {
+                finishStage(&t->stages[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Splits the stages between num_threads threads pinned to distinct cores,
+// zero threads means one per core
+int runThreadedRelay(Stage* stages, size_t num_stages, Relay relay, const Sizing* sizing, size_t num_threads) {
+    CPU* cpus = NULL;
+    int num_cores = 0;
+    int num_cpus = orderedCPUs(&cpus, &num_cores);
+    if (num_cpus < 0) {
+        perror("Failed to get CPU affinity");
+        return -1;
+    }
+    if (!num_threads) {
+        num_threads = num_cores;
+    }
+    num_threads = minSize(num_threads, num_stages);
+    RelayThread* threads = calloc(num_threads, sizeof(*threads));
+    if (!threads) {
+        fprintf(stderr, "Malloc failed\n");
+        free(cpus);
+        return -1;
+    }
+
+    int rc = 0;
+    size_t num_started = 0;
+    for (size_t k = 0; k < num_threads; k++) {
+        RelayThread* t = &threads[k];
+        size_t first = num_stages * k / num_threads;
+        t->stages = stages + first;
+        t->num_stages = num_stages * (k + 1) / num_threads - first;
+        t->relay = relay;
+        t->sizing = *sizing;
+        t->sizing.budget = sizing->budget / num_threads;
+        t->sizing.used = sizing->used / num_stages * t->num_stages;
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (num_cpus) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[k % num_cpus].cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+            DEBUG_PRINT("Relay thread %zu runs %zu stages on CPU %d\n", k, t->num_stages, cpus[k % num_cpus].cpu);
+        }
+        int err = pthread_create(&t->thread, &attr, runRelayThread, t);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            errno = err;
+            perror("Failed to create relay thread");
+            rc = -1;
+            break;
+        }
+        num_started++;
+    }
+    for (size_t k = 0; k < num_started; k++) {
+        pthread_join(threads[k].thread, NULL);
+        rc = threads[k].rc < 0 ? -1: rc;
+    }
+    free(threads);
+    free(cpus);
+    return rc;
+}
+
+// Single producer, single consumer byte ring shared by child i and
+// child i + 1. Both sides only move their own position, so the steady
+// state needs no syscalls: a side sleeps on a futex only when the ring is
+// full or empty, and the other side only wakes it if it says it sleeps.
+// Each cache line is written by one side only
+typedef struct {
+    // Written by the producer
+    _Alignas(64) uint64_t tail;
+    uint32_t data_seq;
+    uint32_t producer_waiting;
+    uint32_t closed;
+    // Written by the consumer
+    _Alignas(64) uint64_t head;
+    uint32_t space_seq;
+    uint32_t consumer_waiting;
+} ShmRingHeader;
+
+typedef struct {
+    ShmRingHeader* header;
+    char* data;
+    // A power of two
+    size_t capacity;
+} ShmRing;
+
+enum {SHM_RING_SIZE = 1 << 20};
+
+// The rings live in shared memory that the children inherit, so the
+// futexes must not be process private
+void futexWait(uint32_t* word, uint32_t value) {
+    syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+void futexWake(uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Waits for free space and returns the contiguous part of it
+size_t shmRingAcquireWrite(ShmRing* ring, char** ptr) {
+    ShmRingHeader* header = ring->header;
+    uint64_t tail = header->tail;
+    while (true) {
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        size_t free_size = ring->capacity - (tail - head);
+        if (free_size) {
+            size_t offset = tail & (ring->capacity - 1);
+            *ptr = ring->data + offset;
+            return minSize(free_size, ring->capacity - offset);
+        }
+        // The consumer bumps space_seq after moving head if it sees the flag,
+        // so either the recheck sees the new head or the wait returns
+        uint32_t seq = __atomic_load_n(&header->space_seq, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&header->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == head) {
+            futexWait(&header->space_seq, seq);
+        }
+        __atomic_store_n(&header->producer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+void shmRingCommitWrite(ShmRing* ring, size_t size) {
+    ShmRingHeader* header = ring->header;
+    __atomic_store_n(&header->tail, header->tail + size, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&header->data_seq, 1, __ATOMIC_SEQ_CST);
+        futexWake(&header->data_seq);
+    }
+}
+
+void shmRingClose(ShmRing* ring) {
+    ShmRingHeader* header = ring->header;
+    __atomic_store_n(&header->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&header->data_seq, 1, __ATOMIC_SEQ_CST);
+    futexWake(&header->data_seq);
+}
+
+// Waits for data and returns the contiguous part of it,
+// 0 once the producer has closed the ring and it is empty
+size_t shmRingAcquireRead(ShmRing* ring, char** ptr) {
+    ShmRingHeader* header = ring->header;
+    uint64_t head = header->head;
+    while (true) {
+        uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+        if (tail != head) {
+            size_t offset = head & (ring->capacity - 1);
+            *ptr = ring->data + offset;
+            return minSize(tail - head, ring->capacity - offset);
+        }
+        // The producer moves tail before it closes the ring
+        if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&header->tail, __ATOMIC_ACQUIRE) == head) {
+                return 0;
+            }
+            continue;
+        }
+        uint32_t seq = __atomic_load_n(&header->data_seq, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) == head and
+            !__atomic_load_n(&header->closed, __ATOMIC_SEQ_CST)
+        ) {
+            futexWait(&header->data_seq, seq);
+        }
+        __atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+void shmRingCommitRead(ShmRing* ring, size_t size) {
+    ShmRingHeader* header = ring->header;
+    __atomic_store_n(&header->head, header->head + size, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->producer_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&header->space_seq, 1, __ATOMIC_SEQ_CST);
+        futexWake(&header->space_seq);
+    }
+}
+
+// Child i copies from ring i - 1 to ring i with one memcpy per chunk.
+// The first child reads the input straight into its ring and the last
+// one writes its ring straight to stdout
+int runShmChild(ShmRing* in, ShmRing* out, int file_fd) {
+    Prefetch prefetch = {
+        .fd = file_fd,
+    };
+    if (!in) {
+        posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        prefetchInput(&prefetch, 0);
+    }
+    while (true) {
+        char* src = NULL;
+        char* dst = NULL;
+        size_t size = out ? shmRingAcquireWrite(out, &dst): SHM_RING_SIZE;
+        if (in) {
+            size = minSize(size, shmRingAcquireRead(in, &src));
+            if (!size) {
+                break;
+            }
+        }
+
+        if (!in) {
+            ssize_t num_read = read(file_fd, dst, size);
+            if (num_read < 0) {
+                perror("Child: read failed");
+                return -1;
+            }
+            if (!num_read) {
+                break;
+            }
+            size = num_read;
+            prefetchInput(&prefetch, size);
+        }
+        else if (!out) {
+            for (size_t total_write = 0; total_write < size;) {
+                ssize_t num_write = write(STDOUT_FILENO, src + total_write, size - total_write);
+                if (num_write < 0) {
+                    perror("Child: write failed");
+                    return -1;
+                }
+                total_write += num_write;
+            }
+        }
+        else {
+            memcpy(dst, src, size);
+        }
+
+        if (in) {
+            shmRingCommitRead(in, size);
+        }
+        if (out) {
+            shmRingCommitWrite(out, size);
+        }
+    }
+    if (out) {
+        shmRingClose(out);
+    }
+    return 0;
+}
+
+// Runs the chain over shared memory rings. The parent only waits for the
+// children, and kills the rest if one fails since its neighbours would
+// otherwise wait on its ring forever
+int runShmPipeline(unsigned n, int file_fd, size_t ring_size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t header_size = (sizeof(ShmRingHeader) + page_size - 1) / page_size * page_size;
+    size_t ring_stride = header_size + ring_size;
+    size_t shm_size = (n - 1) * ring_stride;
+    char* shm = NULL;
+    if (shm_size) {
+        int shm_fd = memfd_create("pipeline", MFD_CLOEXEC);
+        if (shm_fd < 0 or ftruncate(shm_fd, shm_size) < 0) {
+            perror("Failed to create shared memory");
+            return -1;
+        }
+        shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        close(shm_fd);
+        if (shm == MAP_FAILED) {
+            perror("Failed to map shared memory");
+            return -1;
+        }
+    }
+    ShmRing* rings = calloc(n, sizeof(*rings));
+    pid_t* pids = calloc(n, sizeof(*pids));
+    if (!rings or !pids) {
+        fprintf(stderr, "Malloc failed\n");
+        return -1;
+    }
+    for (unsigned i = 0; i + 1 < n; i++) {
+        rings[i] = (ShmRing) {
+            .header = (ShmRingHeader*) (shm + i * ring_stride),
+            .data = shm + i * ring_stride + header_size,
+            .capacity = ring_size,
+        };
+    }
+
+    int rc = 0;
+    unsigned num_spawned = 0;
+    for (unsigned i = 0; i < n; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Failed to create child");
+            rc = -1;
+            break;
+        }
+        if (!pid) {
+            if (closeOtherFds(i == 0 ? file_fd: STDOUT_FILENO, STDOUT_FILENO) < 0) {
+                perror("Fd close failed");
+                exit(-1);
+            }
+            if (n == 1) {
+                // Without neighbours there is no ring to share
+                runInputChild(file_fd, STDOUT_FILENO, MODE_SPLICE, INPUT_DEFAULT, false);
+            }
+            exit(runShmChild(i > 0 ? &rings[i - 1]: NULL, i + 1 < n ? &rings[i]: NULL, file_fd));
+        }
+        DEBUG_PRINT("Spawn child %d\n", pid);
+        pids[i] = pid;
+        num_spawned++;
+    }
+    close(file_fd);
+
+    for (unsigned k = 0; k < num_spawned; k++) {
+        int status = 0;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            perror("Failed to wait for children");
+            return -1;
+        }
+        for (unsigned i = 0; i < num_spawned; i++) {
+            if (pids[i] == pid) {
+                pids[i] = 0;
+            }
+        }
+        if (rc == 0 and (!WIFEXITED(status) or WEXITSTATUS(status))) {
+            fprintf(stderr, "Child %d failed, stop the others\n", pid);
+            rc = -1;
+        }
+        for (unsigned i = 0; rc and i < num_spawned; i++) {
+            if (pids[i]) {
+                kill(pids[i], SIGKILL);
+            }
+        }
+    }
+    free(pids);
+    free(rings);
+    if (shm) {
+        munmap(shm, shm_size);
+    }
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    Mode mode = MODE_COPY;
+    Relay relay = RELAY_POLL;
+    size_t budget = 0;
+    bool threaded = false;
+    size_t num_threads = 0;
+    StatsFormat stats_format = STATS_NONE;
+    Input input = INPUT_DEFAULT;
+    // Set by the options that only the relay modes use
+    bool relay_options = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:a:r:t:s:i:")) != -1) {
+        relay_options = relay_options or strchr("rtsi", opt);
+        if (opt == 'm' and !strcmp(optarg, "copy")) {
+            mode = MODE_COPY;
+        }
+        else if (opt == 'm' and !strcmp(optarg, "splice")) {
+            mode = MODE_SPLICE;
+        }
+        else if (opt == 'm' and !strcmp(optarg, "shm")) {
+            mode = MODE_SHM;
+        }
+        else if (opt == 'a' and strtoull(optarg, NULL, 10) > 0) {
+            budget = strtoull(optarg, NULL, 10) << 20;
+        }
+        else if (opt == 'r' and !strcmp(optarg, "poll")) {
+            relay = RELAY_POLL;
+        }
+        else if (opt == 'r' and !strcmp(optarg, "epoll")) {
+            relay = RELAY_EPOLL;
+        }
+        else if (opt == 't') {
+            threaded = true;
+            num_threads = strtoull(optarg, NULL, 10);
+        }
+        else if (opt == 's' and !strcmp(optarg, "table")) {
+            stats_format = STATS_TABLE;
+        }
+        else if (opt == 's' and !strcmp(optarg, "json")) {
+            stats_format = STATS_JSON;
+        }
+        else if (opt == 'i' and !strcmp(optarg, "read")) {
+            input = INPUT_READ;
+        }
+        else if (opt == 'i' and !strcmp(optarg, "mmap")) {
+            input = INPUT_MMAP;
+        }
+        else if (opt == 'i' and !strcmp(optarg, "sendfile")) {
+            input = INPUT_SENDFILE;
+        }
+        else if (opt == 'i' and !strcmp(optarg, "splice")) {
+            input = INPUT_SPLICE;
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr,
+            "Usage: %s [-m copy|splice|shm] [-i read|mmap|sendfile|splice] [-a budget_mb]\n"
+            "    [-r poll|epoll] [-t threads] [-s table|json] n file\n",
+            argv[0]
+        );
+        return -1;
+    }
+    if (mode == MODE_SHM and relay_options) {
+        fprintf(stderr, "Shm mode has no relay, -r, -t, -s and -i do not apply\n");
+        return -1;
+    }
+    argv += optind - 1;
+    bool adaptive = budget > 0;
+
+    char* end = NULL;
+    long long n = strtoll(argv[1], &end, 10);
+    if (*end or n <= 0) {
+        fprintf(stderr, "N must be an non-negative integer\n");
+        return -1;
+    }
+    if (errno == ERANGE or n > UINT_MAX) {
+        fprintf(stderr, "N is too large. Use a smaller value\n");
+        return -1;
+    }
+    // The relay holds two pipe fds per stage
+    struct rlimit nofile;
+    if (!getrlimit(RLIMIT_NOFILE, &nofile) and nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    const char* file_name = argv[2];
+    int file_fd = open(file_name, O_RDONLY);
+    if (file_fd < 0) {
+        perror("Failed to open file");
+        return -1;
+    }
+
+    if (mode == MODE_SHM) {
+        // With a budget every ring gets an equal power of two share of it
+        size_t ring_size = SHM_RING_SIZE;
+        while (adaptive and ring_size > MIN_CAPACITY and (n - 1) * ring_size > budget) {
+            ring_size /= 2;
+        }
+        return runShmPipeline(n, file_fd, ring_size);
+    }
+
+    size_t pipe_size = adaptive ? initialCapacity(n - 1, mode, budget): 0;
+    int* write_fds = NULL;
+    int* read_fds = NULL;
+    DEBUG_PRINT("Spawn children\n");
+    if (spawnChildren(n, file_fd, mode, input, pipe_size, &write_fds, &read_fds) < 0) {
+        fprintf(stderr, "Failed to spawn all children\n");
+        return -1;
+    }
+    close(file_fd);
+
+    size_t num_stages = n - 1;
+    if (!num_stages) {
+        return 0;
+    }
+    Stage* stages = calloc(num_stages, sizeof(*stages));
+    if (!stages) {
+        fprintf(stderr, "Malloc failed\n");
+        return -1;
+    }
+    uint64_t start_ns = nowNs();
+    for (unsigned i = 0; i < num_stages; i++) {
+        stages[i].read_fd = read_fds[i];
+        stages[i].write_fd = write_fds[i];
+        stages[i].wait = WAIT_READ;
+        stages[i].wait_since_ns = start_ns;
+    }
+
+    // SIGUSR1 dumps the stats at any time, -s also dumps them at exit
+    StatsDumper dumper = {
+        .stages = stages,
+        .num_stages = num_stages,
+        .format = stats_format == STATS_JSON ? STATS_JSON: STATS_TABLE,
+    };
+    sigset_t dump_set;
+    sigemptyset(&dump_set);
+    sigaddset(&dump_set, SIGUSR1);
+    pthread_t dumper_thread;
+    if (pthread_sigmask(SIG_BLOCK, &dump_set, NULL) or
+        pthread_create(&dumper_thread, NULL, runStatsDumper, &dumper)
+    ) {
+        fprintf(stderr, "Failed to start stats dumper\n");
+        return -1;
+    }
+
+    Sizing sizing = {
+        .mode = mode,
+        .budget = budget,
+        .max_capacity = maxPipeSize(),
+    };
+    clock_gettime(CLOCK_MONOTONIC, &sizing.last_adapt);
+    if (adaptive) {
+        DEBUG_PRINT("Allocate adaptive buffers\n");
+        for (unsigned i = 0; i < num_stages; i++) {
+            stages[i].capacity = pipe_size;
+            if (mode == MODE_COPY and !(stages[i].buffer = malloc(pipe_size))) {
+                fprintf(stderr, "Malloc failed\n");
+                return -1;
+            }
+        }
+        sizing.used = num_stages * stageMemory(mode, pipe_size);
+    }
+    else if (mode == MODE_COPY) {
+        char** buffers = NULL;
+        size_t* buffer_sizes = NULL;
+        char* allocation = NULL;
+        DEBUG_PRINT("Allocate buffers\n");
+        if (allocateBuffers(n, &buffers, &buffer_sizes, &allocation) < 0) {
+            fprintf(stderr, "Malloc failed\n");
+            return -1;
+        }
+        for (unsigned i = 0; i < num_stages; i++) {
+            stages[i].buffer = buffers[i];
+            stages[i].capacity = buffer_sizes[i];
+        }
+    }
+    else {
+        for (unsigned i = 0; i < num_stages; i++) {
+            stages[i].capacity = SPLICE_SIZE;
+        }
+    }
+
+    int rc = 0;
+    if (threaded) {
+        rc = runThreadedRelay(stages, num_stages, relay, &sizing, num_threads);
+    }
+    else {
+        rc = relay == RELAY_EPOLL ?
+            runEpollRelay(stages, num_stages, &sizing):
+            runPollRelay(stages, num_stages, &sizing);
+    }
+    if (stats_format != STATS_NONE) {
+        dumpStats(stages, num_stages, stats_format, stderr);
+    }
+    return rc;
+}
@@ -0,0 +1,149 @@
+// This program measures SemServer to SemClient throughput on a large
+// input for a few ring layouts, handing slots over either through
+// semaphores or through futexes. The 1:4 layout with semaphores has a single
+// 4 KB buffer in flight like the original transfer did.
+//
+// Usage: SemBenchmark [-d bin_dir] [-s size_mb] [slots:chunk_kb...]
+#include <fcntl.h>
+#include <iso646.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* transports[] = {
+    "sem",
+    "futex",
+};
+
+// Runs args with stdout on out_fd if it is not negative
+pid_t spawn(char* const* args, int out_fd) {
+    pid_t pid = fork();
+    if (!pid) {
+        if (out_fd >= 0) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        execv(args[0], args);
+        perror("Failed to run child");
+        exit(-1);
+    }
+    return pid;
+}
+
+// Runs a server and a client that prints everything to /dev/null,
+// fails unless both of them finish the transfer
+int runTransfer(char* const* server_args, char* const* client_args) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        perror("Failed to open /dev/null");
+        return -1;
+    }
+    pid_t pids[] = { spawn(server_args, -1), -1 };
+    if (pids[0] > 0) {
+        pids[1] = spawn(client_args, null_fd);
+        if (pids[1] < 0) {
+            // The server would wait for a client forever
+            kill(pids[0], SIGTERM);
+        }
+    }
+    close(null_fd);
+    int rc = 0;
+    for (size_t i = 0; i < sizeof(pids) / sizeof(*pids); i++) {
+        int status = 0;
+        if (pids[i] <= 0 or waitpid(pids[i], &status, 0) < 0 or !WIFEXITED(status) or WEXITSTATUS(status)) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    const char* bin_dir = ".";
+    size_t size_mb = 1024;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:")) != -1) {
+        switch (opt) {
+        case 'd':
+            bin_dir = optarg;
+            break;
+        case 's':
+            size_mb = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d bin_dir] [-s size_mb] [slots:chunk_kb...]\n", argv[0]);
+            return -1;
+        }
+    }
+    static const char* default_layouts[] = { "1:4", "4:4", "1:64", "8:64", "32:64" };
+    const char** layouts = (const char**) argv + optind;
+    size_t layouts_count = argc - optind;
+    if (!layouts_count) {
+        layouts = default_layouts;
+        layouts_count = sizeof(default_layouts) / sizeof(*default_layouts);
+    }
+
+    char server[PATH_MAX];
+    char client[PATH_MAX];
+    snprintf(server, sizeof(server), "%s/SemServer", bin_dir);
+    snprintf(client, sizeof(client), "%s/SemClient", bin_dir);
+
+    const char* tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR"): "/tmp";
+    char file_name[PATH_MAX];
+    snprintf(file_name, sizeof(file_name), "%s/sem_benchmark_XXXXXX", tmp_dir);
+    int fd = mkstemp(file_name);
+    if (fd < 0) {
+        perror("Failed to create input file");
+        return -1;
+    }
+    // The transfer does not look at the bytes, so a sparse file will do
+    int rc = ftruncate(fd, size_mb << 20);
+    close(fd);
+    if (rc < 0) {
+        perror("Failed to size input file");
+        unlink(file_name);
+        return -1;
+    }
+
+    printf("%-6s %6s %10s %10s %10s\n", "sync", "slots", "chunk_kb", "seconds", "MB/s");
+    for (size_t k = 0; k < layouts_count and !rc; k++) {
+        char slots[32] = "";
+        const char* chunk_kb = strchr(layouts[k], ':');
+        if (!chunk_kb or chunk_kb - layouts[k] >= (ptrdiff_t) sizeof(slots)) {
+            fprintf(stderr, "Layout %s is not slots:chunk_kb\n", layouts[k]);
+            rc = -1;
+            break;
+        }
+        memcpy(slots, layouts[k], chunk_kb - layouts[k]);
+        chunk_kb++;
+
+        for (size_t t = 0; t < sizeof(transports) / sizeof(*transports) and !rc; t++) {
+            char* server_args[8] = { server, "-n", slots, "-c", (char*) chunk_kb };
+            size_t num_args = 5;
+            if (!strcmp(transports[t], "futex")) {
+                server_args[num_args++] = "-f";
+            }
+            server_args[num_args++] = file_name;
+            char* client_args[] = { client, NULL };
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            rc = runTransfer(server_args, client_args);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (rc < 0) {
+                fprintf(stderr, "Transfer %s with layout %s failed\n", transports[t], layouts[k]);
+                rc = -1;
+                break;
+            }
+            double d = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            printf("%-6s %6s %10s %10.3f %10.1f\n", transports[t], slots, chunk_kb, d, size_mb / d);
+            fflush(stdout);
+        }
+    }
+
+    unlink(file_name);
+    return rc;
+}
@@ -2,9 +2,12 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <stdbool.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 enum {
@@ -13,9 +16,9 @@ enum {
     // There is a client in this block if this is one
     BLOCK_CLIENT_SEM_ID,
 
-    // Number of buffers that can be read from
+    // Number of slots that can be read from
     BLOCK_FULL_SEM_ID,
-    // Number of buffers that can be written to
+    // Number of slots that can be written to
     BLOCK_EMPTY_SEM_ID,
     // Server has set everything up
     BLOCK_INIT_SEM_ID,
@@ -97,7 +100,7 @@ int getSemaphoreSet() {
     return sem;
 }
 
-int acquireServer(int sem_set) {
+int acquireServer(int sem_set, SharedMemory* shm, size_t num_slots, size_t chunk_size, bool use_futex) {
     struct sembuf ops[] = {
         {
             .sem_num = BLOCK_SERVER_SEM_ID,
@@ -130,7 +133,16 @@ int acquireServer(int sem_set) {
         return -1;
     }
 
-    v.val = 1;
+    shm->num_slots = num_slots;
+    shm->chunk_size = chunk_size;
+    shm->use_futex = use_futex;
+    shm->head = 0;
+    shm->tail = 0;
+    shm->server_waiting = 0;
+    shm->client_waiting = 0;
+    DEBUG_PRINT("Use %zu slots of %zu bytes%s\n", num_slots, chunk_size, use_futex ? " with futexes": "");
+
+    v.val = num_slots;
     errno = 0;
     DEBUG_PRINT("Set empty sem to %d\n", v.val);
     semctl(sem_set, BLOCK_EMPTY_SEM_ID, SETVAL, v);
@@ -240,6 +252,116 @@ int waitForServer(int sem_set) {
     return semop(sem_set, wait_ops, ARRAY_SIZE(wait_ops));
 }
 
+// The segment is shared between processes, so the futexes must not be private.
+// Sleeps until the word changes from value or the timeout passes
+static int futexWait(uint32_t* word, uint32_t value) {
+    // A dead peer never wakes us, so check on it this often
+    struct timespec timeout = {
+        .tv_nsec = 100 * 1000 * 1000,
+    };
+    return syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futexWake(uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// The peer's block semaphore drops to zero through SEM_UNDO when it exits
+static bool isPeerAlive(int sem_set, int peer_sem_id) {
+    return semctl(sem_set, peer_sem_id, GETVAL) > 0;
+}
+
+// Waits until *word differs from value. Only sets the waiting flag and sleeps
+// when it still does not, the peer moves the word before reading the flag,
+// so one of them always sees the other. Returns -1 if the peer exits without
+// moving the word
+static int waitForWord(
+    int sem_set, int peer_sem_id, uint32_t* word, uint32_t value, uint32_t* waiting
+) {
+    while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == value) {
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        int res = 0;
+        if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == value) {
+            res = futexWait(word, value);
+        }
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+        if (res == -1 && errno == ETIMEDOUT && !isPeerAlive(sem_set, peer_sem_id)) {
+            // The peer may have moved the word just before it exited
+            if (__atomic_load_n(word, __ATOMIC_ACQUIRE) == value) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Publishes the new value and wakes the peer only if it sleeps on it
+static void advanceWord(uint32_t* word, uint32_t value, uint32_t* peer_waiting) {
+    __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(peer_waiting, __ATOMIC_SEQ_CST)) {
+        futexWake(word);
+    }
+}
+
+static int copyIntoSharedMemoryFutex(int sem_set, SharedMemory* shm, int fd) {
+    DEBUG_PRINT("Begin copying to shm with futexes\n");
+    for (uint32_t tail = 0; ; tail++) {
+        uint32_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+        if (tail - head == shm->num_slots) {
+            DEBUG_PRINT("Wait for client to read\n");
+            if (waitForWord(sem_set, BLOCK_CLIENT_SEM_ID, &shm->head, head, &shm->server_waiting) == -1) {
+                fprintf(stderr, "Client has died\n");
+                return -1;
+            }
+        }
+
+        TransferBuffer* buffer = &shm->slots[tail % shm->num_slots];
+        buffer->size = read(fd, buffer->buffer, shm->chunk_size);
+        if (buffer->size < 0) {
+            perror("Failed to read from fd");
+            return -1;
+        }
+        DEBUG_PRINT("Read %zd bytes into slot %u\n", buffer->size, tail % (uint32_t) shm->num_slots);
+        advanceWord(&shm->tail, tail + 1, &shm->client_waiting);
+
+        if (!buffer->size) {
+            DEBUG_PRINT("EOF\n");
+            return 0;
+        }
+    }
+}
+
+static int copyFromSharedMemoryFutex(int sem_set, SharedMemory* shm, int fd) {
+    DEBUG_PRINT("Begin copying from shm with futexes\n");
+    for (uint32_t head = 0; ; head++) {
+        if (__atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE) == head) {
+            DEBUG_PRINT("Wait for server to write\n");
+            if (waitForWord(sem_set, BLOCK_SERVER_SEM_ID, &shm->tail, head, &shm->client_waiting) == -1) {
+                fprintf(stderr, "Server has died\n");
+                return -1;
+            }
+        }
+
+        const TransferBuffer* buffer = &shm->slots[head % shm->num_slots];
+        if (!buffer->size) {
+            DEBUG_PRINT("EOF\n");
+            return 0;
+        }
+        DEBUG_PRINT("Write chunk from slot %u\n", head % (uint32_t) shm->num_slots);
+        for (ssize_t total_num_written = 0; total_num_written < buffer->size;) {
+            ssize_t num_written = write(
+                fd, buffer->buffer + total_num_written, buffer->size - total_num_written
+            );
+            if (num_written < 0) {
+                perror("Failed to write to fd");
+                return -1;
+            }
+            total_num_written += num_written;
+        }
+        advanceWord(&shm->head, head + 1, &shm->server_waiting);
+    }
+}
+
 int copyIntoSharedMemory(int sem_set, SharedMemory* shm, int fd) {
     DEBUG_PRINT("Wait for client\n");
     int res = waitForClient(sem_set);
@@ -247,9 +369,12 @@ int copyIntoSharedMemory(int sem_set, SharedMemory* shm, int fd) {
         perror("Failed to wait for client");
         return -1;
     }
+    if (shm->use_futex) {
+        return copyIntoSharedMemoryFutex(sem_set, shm, fd);
+    }
 
     DEBUG_PRINT("Begin copying to shm\n");
-    while (true) {
+    for (size_t slot = 0; ; slot = (slot + 1) % shm->num_slots) {
         DEBUG_PRINT("Wait for client to read\n");
         struct sembuf wait_ops[] = {
             {
@@ -284,13 +409,14 @@ int copyIntoSharedMemory(int sem_set, SharedMemory* shm, int fd) {
             return -1;
         }
 
-        DEBUG_PRINT("Read chunk\n");
-        shm->buffer.size = read(fd, shm->buffer.buffer, sizeof(shm->buffer.buffer));
-        if (shm->buffer.size < 0) {
+        DEBUG_PRINT("Read chunk into slot %zu\n", slot);
+        TransferBuffer* buffer = &shm->slots[slot];
+        buffer->size = read(fd, buffer->buffer, shm->chunk_size);
+        if (buffer->size < 0) {
             perror("Failed to read from fd");
             return -1;
         }
-        DEBUG_PRINT("Read %zd bytes\n", shm->buffer.size);
+        DEBUG_PRINT("Read %zd bytes\n", buffer->size);
 
         DEBUG_PRINT("Wake up client\n");
         struct sembuf write_op = {
@@ -304,23 +430,26 @@ int copyIntoSharedMemory(int sem_set, SharedMemory* shm, int fd) {
             return -1;
         }
 
-        if (!shm->buffer.size) {
+        if (!buffer->size) {
             DEBUG_PRINT("EOF\n");
             return 0;
         }
     }
 }
 
-int copyFromSharedMemory(int sem_set, const volatile SharedMemory* shm, int fd) {
+int copyFromSharedMemory(int sem_set, SharedMemory* shm, int fd) {
     DEBUG_PRINT("Wait for server\n");
     int res = waitForServer(sem_set);
     if (res == -1) {
         perror("Failed to wait for server");
         return -1;
     }
+    if (shm->use_futex) {
+        return copyFromSharedMemoryFutex(sem_set, shm, fd);
+    }
 
     DEBUG_PRINT("Begin copying from shm\n");
-    while (true) {
+    for (size_t slot = 0; ; slot = (slot + 1) % shm->num_slots) {
         DEBUG_PRINT("Wait for server to write\n");
         struct sembuf wait_ops[] = {
             {
@@ -344,6 +473,17 @@ int copyFromSharedMemory(int sem_set, const volatile SharedMemory* shm, int fd)
         };
         errno = 0;
         semop(sem_set, wait_ops, ARRAY_SIZE(wait_ops));
+        if (errno == EAGAIN) {
+            // The server may have filled the rest of the slots and exited,
+            // it only died early if there is nothing left to read
+            struct sembuf drain_op = {
+                .sem_num = BLOCK_FULL_SEM_ID,
+                .sem_op = -1,
+                .sem_flg = IPC_NOWAIT,
+            };
+            errno = 0;
+            semop(sem_set, &drain_op, 1);
+        }
         if (errno) {
             if (errno == EAGAIN) {
                 fprintf(stderr, "Server has died\n");
@@ -355,11 +495,14 @@ int copyFromSharedMemory(int sem_set, const volatile SharedMemory* shm, int fd)
             }
         }
         
-        if (shm->buffer.size > 0) {
-            DEBUG_PRINT("Write chunk\n");
+        const volatile TransferBuffer* buffer = &shm->slots[slot];
+        if (buffer->size > 0) {
+            DEBUG_PRINT("Write chunk from slot %zu\n", slot);
             ssize_t total_num_written = 0;
-            while (total_num_written < shm->buffer.size) {
-                ssize_t num_written = write(fd, shm->buffer.buffer, shm->buffer.size);
+            while (total_num_written < buffer->size) {
+                ssize_t num_written = write(
+                    fd, (const char*) buffer->buffer + total_num_written, buffer->size - total_num_written
+                );
                 if (num_written < 0) {
                     perror("Failed to write to fd");
                     return -1;
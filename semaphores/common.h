@@ -1,4 +1,6 @@
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef DEBUG 
@@ -9,19 +11,37 @@
 
 typedef struct {
     ssize_t size;
-    enum { BUFFER_SIZE = 4096};
+    enum { BUFFER_SIZE = 64 * 1024 };
     char buffer[BUFFER_SIZE];
 } TransferBuffer;
 
+enum { MAX_SLOTS = 32 };
+
+// The server fills slots in order while the client drains them, up to
+// num_slots chunks of chunk_size bytes ahead of it
 typedef struct {
-    TransferBuffer buffer;
+    // Set by the server before it signals init
+    size_t num_slots;
+    size_t chunk_size;
+    // Hand slots over through head and tail instead of FULL and EMPTY
+    bool use_futex;
+    TransferBuffer slots[MAX_SLOTS];
+
+    // Number of slots the server has filled, it also is the futex the
+    // client sleeps on when there is nothing to read
+    _Alignas(64) uint32_t tail;
+    uint32_t server_waiting;
+    // Number of slots the client has drained, it also is the futex the
+    // server sleeps on when every slot is full
+    _Alignas(64) uint32_t head;
+    uint32_t client_waiting;
 } SharedMemory;
 
 SharedMemory* getSharedMemory();
 int getSemaphoreSet();
 
-int acquireServer(int sem_set);
+int acquireServer(int sem_set, SharedMemory* shm, size_t num_slots, size_t chunk_size, bool use_futex);
 int acquireClient(int sem_set);
 
 int copyIntoSharedMemory(int sem_set, SharedMemory* shm, int fd);
-int copyFromSharedMemory(int sem_set, const volatile SharedMemory* shm, int fd);
+int copyFromSharedMemory(int sem_set, SharedMemory* shm, int fd);
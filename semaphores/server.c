@@ -1,16 +1,48 @@
 // This program sends data to a client
+//
+// Usage: SemServer [-n slots] [-c chunk_kb] [-f] file_name
+//   -n   number of chunks the server can get ahead of the client
+//   -c   size of each chunk, 4 with -n 1 matches the single buffer transfer
+//   -f   hand slots over through atomics and futexes instead of semaphores,
+//        so only a full or empty ring costs syscalls
 #include "common.h"
 
 #include <fcntl.h>
+#include <iso646.h>
+#include <stdlib.h>
 #include <unistd.h>
 
-int main(int argc, const char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s [file_name]\n", argv[0]);
+int main(int argc, char* argv[]) {
+    size_t num_slots = 8;
+    size_t chunk_size = BUFFER_SIZE;
+    bool use_futex = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:f")) != -1) {
+        switch (opt) {
+        case 'n':
+            num_slots = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            chunk_size = strtoull(optarg, NULL, 10) * 1024;
+            break;
+        case 'f':
+            use_futex = true;
+            break;
+        default:
+            num_slots = 0;
+            break;
+        }
+    }
+    if (optind + 1 != argc or
+        num_slots < 1 or num_slots > MAX_SLOTS or
+        chunk_size < 1 or chunk_size > BUFFER_SIZE
+    ) {
+        fprintf(stderr, "Usage: %s [-n slots] [-c chunk_kb] [-f] file_name\n", argv[0]);
+        fprintf(stderr, "Slots must be from 1 to %d, chunks from 1 to %d KB\n", MAX_SLOTS, BUFFER_SIZE / 1024);
         return -1;
     }
 
-    const char* file_name = argv[1];
+    const char* file_name = argv[optind];
     DEBUG_PRINT("Open %s\n", file_name);
     int in = open(file_name, O_RDONLY);
     if (in < 0) {
@@ -32,7 +64,7 @@ int main(int argc, const char* argv[]) {
         return -1;
     }
 
-    int res = acquireServer(sem_set);
+    int res = acquireServer(sem_set, shm, num_slots, chunk_size, use_futex);
     if (res == -1) {
         fprintf(stderr, "Failed to acquire from server\n");
         return -1;